@@ -43,9 +43,19 @@ rm -rf $RPM_BUILD_ROOT
 
 %files
 %{_libdir}/libnss_external.so*
+%{_bindir}/nss_external_getall
+%{_sbindir}/nss_externald
+%{_sbindir}/nss_external_snapshot
+%{_sbindir}/nss_external_stats
+%{_mandir}/man1/nss_external_getall.1.gz
+%{_mandir}/man3/nss_external_lookup_async.3.gz
 %{_mandir}/man5/nss_external.5.gz
+%{_mandir}/man8/nss_externald.8.gz
+%{_mandir}/man8/nss_external_snapshot.8.gz
+%{_mandir}/man8/nss_external_stats.8.gz
 
 %files devel
+%{_includedir}/nss_external.h
 %{_libdir}/libnss_external.a
 %{_libdir}/libnss_external.la
 
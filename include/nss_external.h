@@ -0,0 +1,81 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Public interface to libnss_external, for programs linked with it
+ * (-lnss_external) rather than going through glibc's NSS.  The NSS
+ * entry points themselves are only meant to be called by glibc.
+ */
+
+#ifndef _NSS_EXTERNAL_H
+#define _NSS_EXTERNAL_H
+
+#include <nss.h>
+#include <pwd.h>
+#include <grp.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bulk export, as nss_external_getall(1) does.  fn is called with each
+ * entry at or above the minimum id, parsed and as the command gave it,
+ * until it returns non-zero; the entry is only valid during the call.
+ * Returns NSS_STATUS_UNAVAIL, with errno set, if the command couldn't
+ * be run or its output was cut short.
+ */
+
+enum nss_status nss_external_getpwall (int (*fn) (struct passwd *pw,
+						  const char *line,
+						  void *arg),
+				       void *arg);
+enum nss_status nss_external_getgrall (int (*fn) (struct group *gr,
+						  const char *line,
+						  void *arg),
+				       void *arg);
+
+/*
+ * Asynchronous lookups, for event loops; see nss_external_lookup_async(3).
+ * by says whether the key is a name or, for passwd and group, a numeric
+ * id.
+ */
+
+#define NSS_EXTERNAL_BYNAME 0
+#define NSS_EXTERNAL_BYID   1
+
+struct nss_external_async;
+
+struct nss_external_async *
+nss_external_lookup_async (const char *database, int by, const char *key,
+			   void (*fn) (enum nss_status status, int err,
+				       void *result, void *arg),
+			   void *arg);
+int nss_external_async_fd (struct nss_external_async *a);
+int nss_external_async_timeout (struct nss_external_async *a);
+int nss_external_async_process (struct nss_external_async *a);
+void nss_external_async_cancel (struct nss_external_async *a);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NSS_EXTERNAL_H */
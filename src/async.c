@@ -0,0 +1,506 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <grp.h>
+#include <shadow.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "nss_external.h"
+
+/*
+ * Asynchronous lookups, for programs built around an event loop, which
+ * can't wait for a command on the loop's thread.
+ * nss_external_lookup_async() starts a lookup and returns at once; the
+ * caller polls the lookup's file descriptor for input, and calls
+ * nss_external_async_process() whenever it's readable, until the lookup
+ * completes and its callback is called.  Any number of lookups may be
+ * in flight at once.
+ *
+ * The lookup goes to the caching daemon if it's running and configured,
+ * otherwise the command is run directly; co-process mode isn't used, as
+ * the co-process answers one request at a time.  The command counts
+ * against the database's maxprocs, like any other, but rather than
+ * block the caller's loop waiting for a turn, the lookup fails at once
+ * if none is free.
+ *
+ * A fresh snapshot, the daemon's shared memory and the process's own
+ * lookup caches are checked first, as the synchronous lookups would;
+ * the lookup is then complete straight away, and its descriptor
+ * already readable.  Answers from commands are remembered in the
+ * caches in turn.  Prefetching isn't used, as fetching the whole
+ * database would hold up the caller's loop, nor are stale entries.
+ *
+ * A command which has answered, but not yet exited, isn't waited for:
+ * it's reaped by a later call instead.
+ */
+
+/*
+ * Commands still to be reaped.
+ */
+
+struct zombie
+{
+  struct zombie *next;
+  int db;
+  pid_t pid;
+};
+
+static pthread_mutex_t zombies_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct zombie *zombies;
+
+struct nss_external_async
+{
+  int db;
+  int type;
+  char *key;
+  void (*fn) (enum nss_status status, int err, void *result, void *arg);
+  void *arg;
+  int fd;
+  pid_t pid;			/* command we started, if any */
+  int daemon;			/* reply ends with an empty line */
+  int ready;
+  long long deadline;
+  char *buf;
+  size_t len, size;
+  char *line;			/* answer, once ready: NULL if unavailable */
+  int err;
+  union
+  {
+    struct passwd pw;
+    struct group gr;
+    struct spwd sp;
+  } result;
+  char *buffer;
+  size_t buflen;
+};
+
+/*
+ * reap:
+ *
+ * Reap whichever of the commands left behind have exited since.
+ */
+
+static void
+reap (void)
+{
+  struct zombie **zp, *z;
+
+  pthread_mutex_lock (&zombies_lock);
+
+  for (zp = &zombies; (z = *zp) != NULL;)
+    {
+      if (cmdreap (z->db, -1, z->pid))
+	{
+	  *zp = z->next;
+	  free (z);
+	}
+      else
+	  zp = &z->next;
+    }
+
+  pthread_mutex_unlock (&zombies_lock);
+}
+
+/*
+ * release:
+ *
+ * Free a lookup, killing its command if it's still running.  If the
+ * command hasn't exited yet, it's left for reap().
+ */
+
+static void
+release (struct nss_external_async *a)
+{
+  struct zombie *z;
+
+  if (a->pid > 0)
+    {
+      if (!a->ready)
+	  kill (a->pid, SIGKILL);
+
+      if (!cmdreap (a->db, a->fd, a->pid))
+	{
+	  if ((z = malloc (sizeof (struct zombie))) == NULL)
+	      cmdwait (a->db, -1, a->pid);
+	  else
+	    {
+	      z->db = a->db;
+	      z->pid = a->pid;
+	      pthread_mutex_lock (&zombies_lock);
+	      z->next = zombies;
+	      zombies = z;
+	      pthread_mutex_unlock (&zombies_lock);
+	    }
+	}
+    }
+  else if (a->fd >= 0)
+      close (a->fd);
+
+  free (a->key);
+  free (a->buf);
+  free (a->line);
+  free (a->buffer);
+  free (a);
+}
+
+/*
+ * ready:
+ *
+ * The answer is known: line is a malloc'd entry, or an empty string if
+ * there's none.  If it's NULL, the lookup failed with err.
+ */
+
+static void
+ready (struct nss_external_async *a, char *line, int err)
+{
+  a->ready = 1;
+  a->line = line;
+  a->err = err;
+}
+
+/*
+ * start:
+ *
+ * Send the lookup to the daemon, or start the command.  Returns 0 if
+ * neither could be done.
+ */
+
+static int
+start (struct nss_external_async *a)
+{
+  const struct conf *conf = getconf ();
+  const char *command = conf->db[a->db].command;
+
+  a->deadline = cmdclock () + cmdtimeout (a->db);
+
+  if ((conf->mode == MODE_DAEMON)
+      && ((a->fd = daemon_connect (a->db, KEYARGS (a->key))) >= 0))
+    {
+      a->daemon = 1;
+      a->deadline += DAEMONSLACK;
+    }
+  else if (!cmdcheck (command)
+	   || ((a->fd = cmdexec (a->db, KEYARGS (a->key), 0, &a->pid)) < 0))
+      return 0;
+
+  return fcntl (a->fd, F_SETFL, fcntl (a->fd, F_GETFL) | O_NONBLOCK) == 0;
+}
+
+/*
+ * nss_external_lookup_async
+ *
+ * Start looking up key in database ("passwd", "group" or "shadow"), as
+ * a name if by is NSS_EXTERNAL_BYNAME, or, for passwd and group, as a
+ * numeric id if it's NSS_EXTERNAL_BYID.  When the lookup completes,
+ * fn is called with the status, an errno value, the entry (a struct
+ * passwd, group or spwd, valid only during the call) if it was found,
+ * and arg.  Returns NULL with errno set if the lookup couldn't be
+ * started.
+ */
+
+struct nss_external_async *
+nss_external_lookup_async (const char *database, int by, const char *key,
+			   void (*fn) (enum nss_status status, int err,
+				       void *result, void *arg),
+			   void *arg)
+{
+  struct nss_external_async *a;
+  char *line = NULL;
+  int db, type, found;
+  id_t id = 0;
+
+  for (db = 0; (db < NDB) && (strcmp (database, dbnames[db]) != 0); db++);
+
+  if (by == NSS_EXTERNAL_BYNAME)
+      type = CACHE_NAME;
+  else if (by == NSS_EXTERNAL_BYID)
+      type = CACHE_ID;
+  else
+      type = -1;
+
+  if ((db == NDB) || (type < 0) || !validkey (key)
+      || ((type == CACHE_ID) && ((db == DB_SHADOW) || !parseid (key, &id))))
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  if ((a = calloc (1, sizeof (struct nss_external_async))) == NULL)
+      return NULL;
+
+  a->db = db;
+  a->fn = fn;
+  a->arg = arg;
+  a->fd = -1;
+
+  if ((a->key = strdup (key)) == NULL)
+    {
+      free (a);
+      return NULL;
+    }
+
+  STAT (STAT_ASYNC);
+
+  a->type = type;
+
+  reap ();
+
+  if (getenv (DISABLE))
+      ready (a, strdup (""), ENOMEM);
+  else if ((db == DB_SHADOW) && (geteuid () != 0))
+      ready (a, NULL, EPERM);
+  else if ((type == CACHE_ID) && (id < idfloor (db)))
+      ready (a, strdup (""), ENOMEM);
+  else if ((found = snapshot_get (db, type, key, &line)) >= 0)
+      ready (a, found ? line : strdup (""), ENOMEM);
+  else if (shm_get (db, type, key, &line)
+	   || cache_get (&lookups[db].cache, type, key, &line)
+	   || cache_get (&lookups[db].negcache, type, key, &line))
+      ready (a, line, ENOMEM);
+  else if (!start (a))
+    {
+      if (a->pid > 0)
+	  kill (a->pid, SIGKILL);
+      ready (a, NULL, ENOENT);
+    }
+
+  /*
+   * A lookup which is already complete gets a descriptor that's
+   * already readable, so that it goes through the caller's loop like
+   * any other.
+   */
+
+  if (a->ready && (a->pid <= 0))
+    {
+      if (a->fd >= 0)
+	  close (a->fd);
+
+      if ((a->fd = eventfd (1, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+	{
+	  release (a);
+	  return NULL;
+	}
+    }
+
+  return a;
+}
+
+/*
+ * nss_external_async_fd
+ *
+ * The descriptor to poll for input.
+ */
+
+int
+nss_external_async_fd (struct nss_external_async *a)
+{
+  return a->fd;
+}
+
+/*
+ * nss_external_async_timeout
+ *
+ * Milliseconds until the lookup times out, for the caller's poll.  When
+ * that comes, call nss_external_async_process() regardless.
+ */
+
+int
+nss_external_async_timeout (struct nss_external_async *a)
+{
+  long long left;
+
+  if (a->ready)
+      return 0;
+
+  left = a->deadline - cmdclock ();
+  return (left < 0) ? 0 : (left > INT_MAX) ? INT_MAX : (int) left;
+}
+
+/*
+ * parse:
+ *
+ * Parse the answer into the lookup's own buffer, growing it as needed.
+ */
+
+static enum nss_status
+parse (struct nss_external_async *a, int *errnop)
+{
+  const struct lookup *l = &lookups[a->db];
+  enum nss_status status;
+  id_t id;
+  size_t size;
+  char *bigger;
+
+  for (;;)
+    {
+      status = l->parse (&a->result, a->line, a->buffer, a->buflen, errnop);
+
+      if ((status == NSS_STATUS_SUCCESS) && (l->describe != NULL))
+	{
+	  l->describe (&a->result, &id);
+	  if (id < idfloor (a->db))
+	      status = NSS_STATUS_NOTFOUND;
+	}
+
+      if ((status != NSS_STATUS_TRYAGAIN) || (*errnop != ERANGE))
+	  return status;
+
+      size = a->buflen ? a->buflen * 2 : BUFSIZ;
+      if ((bigger = realloc (a->buffer, size)) == NULL)
+	{
+	  *errnop = ENOMEM;
+	  return status;
+	}
+
+      a->buffer = bigger;
+      a->buflen = size;
+    }
+}
+
+/*
+ * receive:
+ *
+ * Read what the command or daemon has to say.  Returns 0 if there's
+ * more to come.
+ */
+
+static int
+receive (struct nss_external_async *a)
+{
+  char **file, *end;
+  ssize_t n;
+
+  for (;;)
+    {
+      if ((cmdclock () >= a->deadline) || !cmdgrow (&a->buf, &a->size, a->len))
+	  break;
+
+      if ((n = read (a->fd, a->buf + a->len, a->size - a->len)) < 0)
+	{
+	  if (errno == EINTR)
+	      continue;
+	  if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+	      return 0;
+	  break;
+	}
+
+      STATADD (STAT_BYTES, n);
+      a->len += n;
+      end = NULL;
+
+      /*
+       * The daemon's reply ends with an empty line, and a command's
+       * output at EOF.
+       */
+
+      if (a->daemon && (a->len > 0))
+	  end = (a->buf[0] == '\n') ? a->buf
+				    : memmem (a->buf, a->len, "\n\n", 2);
+      else if (!a->daemon && (n == 0))
+	  end = a->buf + a->len;
+
+      if (end != NULL)
+	{
+	  file = splitlines (a->buf, end - a->buf);
+	  a->buf = NULL;
+
+	  if (file == NULL)
+	      ready (a, NULL, ENOMEM);
+	  else
+	    {
+	      if (file[0] != NULL)
+		  cache_put (&lookups[a->db].cache, a->type, a->key, file[0]);
+	      else
+		  cache_put (&lookups[a->db].negcache, a->type, a->key, "");
+	      ready (a, strdup (file[0] ? file[0] : ""), ENOMEM);
+	      cmdclose (file);
+	    }
+	  return 1;
+	}
+
+      if (n == 0)
+	  break;
+    }
+
+  if (a->pid > 0)
+      kill (a->pid, SIGKILL);
+  ready (a, NULL, ENOENT);
+
+  return 1;
+}
+
+/*
+ * nss_external_async_process
+ *
+ * Make progress on the lookup, when its descriptor is readable or it's
+ * timed out.  Returns 0 if it's still waiting.  Otherwise the callback
+ * has been called, the lookup freed, and 1 is returned.
+ */
+
+int
+nss_external_async_process (struct nss_external_async *a)
+{
+  enum nss_status status;
+  int err = 0;
+
+  if (!a->ready && !receive (a))
+      return 0;
+
+  if (a->line == NULL)
+    {
+      status = NSS_STATUS_UNAVAIL;
+      err = a->err;
+    }
+  else if (*a->line == '\0')
+    {
+      status = NSS_STATUS_NOTFOUND;
+      err = ENOENT;
+    }
+  else
+      status = parse (a, &err);
+
+  a->fn (status, err, (status == NSS_STATUS_SUCCESS) ? &a->result : NULL,
+	 a->arg);
+
+  release (a);
+  return 1;
+}
+
+/*
+ * nss_external_async_cancel
+ *
+ * Abandon a lookup without calling its callback.
+ */
+
+void
+nss_external_async_cancel (struct nss_external_async *a)
+{
+  release (a);
+}
@@ -0,0 +1,599 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "nss_external.h"
+
+/*
+ * The cache is a chained hash table of entries, with every entry also
+ * threaded onto a doubly linked list in order of insertion, newest at
+ * the head (c->lru.next).  Hits only take the lock shared, so that
+ * lookups of cached entries don't queue behind each other; rather than
+ * moving the entry to the head, they mark it used.  When the cache is
+ * full, used entries at the tail (c->lru.prev) are given a second
+ * chance, moved to the head and unmarked, and the first unused one is
+ * evicted: an approximation of LRU which needs no writes on a hit.
+ */
+
+/*
+ * cache_now:
+ *
+ * Seconds on the monotonic clock, so that TTLs aren't affected by
+ * the wall clock being stepped.
+ */
+
+time_t
+cache_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/*
+ * hash:
+ *
+ * FNV-1a over the key type and key.
+ */
+
+static size_t
+hash (int type, const char *key)
+{
+  size_t h = 2166136261u;
+
+  h = (h ^ (unsigned char) type) * 16777619u;
+  for (; *key != '\0'; key++)
+      h = (h ^ (unsigned char) *key) * 16777619u;
+
+  return h;
+}
+
+static void
+lru_unlink (struct cache_entry *e)
+{
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+}
+
+static void
+lru_push (struct cache *c, struct cache_entry *e)
+{
+  e->prev = &c->lru;
+  e->next = c->lru.next;
+  c->lru.next->prev = e;
+  c->lru.next = e;
+}
+
+/*
+ * find:
+ *
+ * Locate an entry.  If prevp is non-NULL, it receives the address of
+ * the pointer referencing the entry, so that it can be unlinked.
+ * Called with the lock held, shared or exclusive.
+ */
+
+static struct cache_entry *
+find (struct cache *c, int type, const char *key, struct cache_entry ***prevp)
+{
+  struct cache_entry **ep;
+
+  for (ep = &c->table[hash (type, key) & (c->nbuckets - 1)]; *ep != NULL;
+       ep = &(*ep)->hnext)
+      if (((*ep)->type == type) && (strcmp ((*ep)->key, key) == 0))
+	{
+	  if (prevp != NULL)
+	      *prevp = ep;
+	  return *ep;
+	}
+
+  return NULL;
+}
+
+/*
+ * discard:
+ *
+ * Remove an entry from both the hash table and the list, and free it.
+ * Called with the lock held exclusively.
+ */
+
+static void
+discard (struct cache *c, struct cache_entry *e)
+{
+  struct cache_entry **ep;
+
+  if (find (c, e->type, e->key, &ep) == e)
+      *ep = e->hnext;
+
+  lru_unlink (e);
+  c->count--;
+  c->generation++;
+
+  free (e->key);
+  free (e->value);
+  free (e);
+}
+
+/*
+ * evict:
+ *
+ * Evict the least recently used entry, near enough.  Called with the
+ * lock held exclusively.
+ */
+
+static void
+evict (struct cache *c)
+{
+  struct cache_entry *e;
+
+  while ((e = c->lru.prev)->used)
+    {
+      e->used = 0;
+      lru_unlink (e);
+      lru_push (c, e);
+    }
+
+  discard (c, e);
+}
+
+/*
+ * limits:
+ *
+ * The configured size and TTL of the cache.
+ */
+
+static void
+limits (struct cache *c, size_t *maxp, time_t *ttlp)
+{
+  const struct dbconf *d = &getconf ()->db[c->db];
+
+  *maxp = d->cachesize;
+  *ttlp = c->negative ? d->negttl : d->ttl;
+}
+
+/*
+ * setup:
+ *
+ * Allocate the hash table on first use.  The bucket count is the
+ * cache size rounded up to a power of two.  Called with the lock held
+ * exclusively.
+ */
+
+static int
+setup (struct cache *c, size_t max)
+{
+  size_t n;
+
+  if (c->table != NULL)
+      return 1;
+
+  if (max == 0)
+      return 0;
+
+  for (n = 1; n < max; n <<= 1);
+
+  if ((c->table = calloc (n, sizeof (struct cache_entry *))) == NULL)
+      return 0;
+
+  c->nbuckets = n;
+  c->lru.next = c->lru.prev = &c->lru;
+
+  return 1;
+}
+
+/*
+ * cache_get:
+ *
+ * Look up key in the cache.  On a hit, returns 1 and sets *valuep to
+ * a malloc'd copy of the cached line, which the caller must free.
+ * Returns 0 on a miss, or if the entry has expired.  Expired entries
+ * are kept, for cache_stale(), until they're evicted or replaced.
+ */
+
+int
+cache_get (struct cache *c, int type, const char *key, char **valuep)
+{
+  struct cache_entry *e;
+  int hit = 0;
+
+  *valuep = NULL;
+
+  pthread_rwlock_rdlock (&c->lock);
+
+  if ((c->table != NULL) && ((e = find (c, type, key, NULL)) != NULL)
+      && (e->expires > cache_now ())
+      && ((*valuep = strdup (e->value)) != NULL))
+    {
+      if (!__atomic_load_n (&e->used, __ATOMIC_RELAXED))
+	  __atomic_store_n (&e->used, 1, __ATOMIC_RELAXED);
+      hit = 1;
+    }
+
+  pthread_rwlock_unlock (&c->lock);
+
+  if (hit)
+      STAT (c->negative ? STAT_NEGHIT : STAT_CACHEHIT);
+  else if (!c->negative)
+      STAT (STAT_CACHEMISS);
+
+  return hit;
+}
+
+/*
+ * cache_stale:
+ *
+ * Look up an expired entry.  Returns 1 with *valuep set as for
+ * cache_get() if there's one that expired no more than the configured
+ * maxstale seconds ago, or, if any is set, no more than MAXFALLBACK
+ * seconds ago; shadow entries are only ever used within maxstale, since
+ * a password changed or an account locked must take effect.  Returns 2
+ * instead if the caller should refresh the entry: the first caller to
+ * find it stale, and then no more than once per negative TTL, so that a
+ * refresh which fails isn't retried on every lookup.
+ */
+
+int
+cache_stale (struct cache *c, int type, const char *key, int any,
+	     char **valuep)
+{
+  const struct dbconf *d = &getconf ()->db[c->db];
+  time_t now = cache_now ();
+  struct cache_entry *e;
+  int hit = 0;
+
+  *valuep = NULL;
+
+  pthread_rwlock_wrlock (&c->lock);
+
+  if ((c->table != NULL) && ((e = find (c, type, key, NULL)) != NULL)
+      && (now < e->expires + ((any && (c->db != DB_SHADOW))
+			      ? MAXFALLBACK : d->maxstale))
+      && ((*valuep = strdup (e->value)) != NULL))
+    {
+      e->used = 1;
+      hit = 1;
+
+      if (!any && (e->retry <= now))
+	{
+	  e->retry = now + ((d->negttl > 0) ? d->negttl : 1);
+	  hit = 2;
+	}
+    }
+
+  pthread_rwlock_unlock (&c->lock);
+
+  if (hit)
+      STAT (any ? STAT_STALEFALLBACK : STAT_STALEHIT);
+
+  return hit;
+}
+
+/*
+ * cache_put:
+ *
+ * Insert or replace the line stored under key.  If the cache is full,
+ * the least recently used entry is evicted.  Failure to allocate is
+ * not an error; the entry simply isn't cached.  If the cache has been
+ * configured down to nothing, it's emptied instead.
+ */
+
+void
+cache_put (struct cache *c, int type, const char *key, const char *value)
+{
+  struct cache_entry *e;
+  size_t bucket, max;
+  time_t ttl;
+
+  limits (c, &max, &ttl);
+
+  pthread_rwlock_wrlock (&c->lock);
+
+  if (!setup (c, max))
+    {
+      pthread_rwlock_unlock (&c->lock);
+      return;
+    }
+
+  if ((e = find (c, type, key, NULL)) != NULL)
+      discard (c, e);
+
+  while ((c->count > 0) && (c->count >= max))
+      evict (c);
+
+  if (max == 0)
+    {
+      pthread_rwlock_unlock (&c->lock);
+      return;
+    }
+
+  if ((e = calloc (1, sizeof (struct cache_entry))) == NULL)
+    {
+      pthread_rwlock_unlock (&c->lock);
+      return;
+    }
+
+  e->type = type;
+  e->key = strdup (key);
+  e->value = strdup (value);
+  e->expires = cache_now () + ttl;
+
+  if ((e->key == NULL) || (e->value == NULL))
+    {
+      free (e->key);
+      free (e->value);
+      free (e);
+      pthread_rwlock_unlock (&c->lock);
+      return;
+    }
+
+  bucket = hash (type, key) & (c->nbuckets - 1);
+  e->hnext = c->table[bucket];
+  c->table[bucket] = e;
+  lru_push (c, e);
+  c->count++;
+  c->generation++;
+
+  pthread_rwlock_unlock (&c->lock);
+}
+
+/*
+ * cache_line:
+ *
+ * Remember an entry from database db under its name, and for passwd and
+ * group, under its id as well.
+ */
+
+void
+cache_line (struct cache *c, int db, const char *line)
+{
+  char *copy, *fields[4];
+  char key[32];
+  id_t id;
+
+  if ((copy = strdup (line)) == NULL)
+      return;
+
+  if ((splitfields (copy, fields, 4) >= 3) && (*fields[0] != '\0'))
+    {
+      cache_put (c, CACHE_NAME, fields[0], line);
+
+      if ((db != DB_SHADOW) && parseid (fields[2], &id))
+	{
+	  snprintf (key, sizeof key, "%u", (unsigned) id);
+	  cache_put (c, CACHE_ID, key, line);
+	}
+    }
+
+  free (copy);
+}
+
+/*
+ * cache_drop:
+ *
+ * Forget the entry stored under key, if there is one.
+ */
+
+void
+cache_drop (struct cache *c, int type, const char *key)
+{
+  struct cache_entry *e;
+
+  pthread_rwlock_wrlock (&c->lock);
+
+  if ((c->table != NULL) && ((e = find (c, type, key, NULL)) != NULL))
+      discard (c, e);
+
+  pthread_rwlock_unlock (&c->lock);
+}
+
+/*
+ * cache_lines:
+ *
+ * The first line of every live entry, except those cached under an
+ * option such as "--member", as an array in the form cmdopen()
+ * returns, for publishing.  *expiresp is set to when the first of them
+ * expires, or 0 if there are none.
+ */
+
+char **
+cache_lines (struct cache *c, time_t *expiresp)
+{
+  time_t now = cache_now ();
+  struct cache_entry *e;
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *fp;
+
+  *expiresp = 0;
+
+  if ((fp = open_memstream (&buf, &size)) == NULL)
+      return NULL;
+
+  pthread_rwlock_rdlock (&c->lock);
+
+  if (c->table != NULL)
+      for (e = c->lru.next; e != &c->lru; e = e->next)
+	  if ((e->expires > now) && (e->key[0] != '-') && (*e->value != '\0'))
+	    {
+	      fprintf (fp, "%.*s\n", (int) strcspn (e->value, "\n"), e->value);
+	      if ((*expiresp == 0) || (e->expires < *expiresp))
+		  *expiresp = e->expires;
+	    }
+
+  pthread_rwlock_unlock (&c->lock);
+
+  if (fclose (fp) != 0)
+    {
+      free (buf);
+      return NULL;
+    }
+
+  return splitlines (buf, size);
+}
+
+/*
+ * cache_fork:
+ *
+ * Hold the cache's lock across a fork(), so that the child doesn't
+ * inherit it held by a thread it doesn't have.  The child's thread has
+ * a new id, which the lock would take for a reader's, so it starts the
+ * lock afresh rather than unlocking it.
+ */
+
+void
+cache_fork (struct cache *c, int stage)
+{
+  pthread_rwlock_t unlocked =
+    PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+  if (stage == FORK_PREPARE)
+      pthread_rwlock_wrlock (&c->lock);
+  else if (stage == FORK_PARENT)
+      pthread_rwlock_unlock (&c->lock);
+  else
+      c->lock = unlocked;
+}
+
+/*
+ * The line a thread last couldn't fit in its caller's buffer, per
+ * database.  glibc retries with a bigger buffer straight away, and this
+ * lets the retry parse the line again instead of running the command
+ * again, whether or not the cache is enabled.  The line is only good
+ * for KEEPTIME milliseconds, so that a caller which never retries can't
+ * have a later lookup answered from it.  Whatever a thread still holds
+ * when it exits is freed by the key's destructor.
+ */
+
+struct kept
+{
+  long long when;
+  int type;
+  char *key;
+  char *line;
+};
+
+static __thread struct kept kept[NDB];
+static __thread int kept_registered;
+static pthread_key_t kept_key;
+static pthread_once_t kept_once = PTHREAD_ONCE_INIT;
+
+/*
+ * kept_free:
+ *
+ * Free the lines a thread kept, when it exits.
+ */
+
+static void
+kept_free (void *arg)
+{
+  struct kept *k = arg;
+  int db;
+
+  for (db = 0; db < NDB; db++)
+    {
+      free (k[db].key);
+      free (k[db].line);
+      k[db].key = k[db].line = NULL;
+    }
+}
+
+/*
+ * kept_init:
+ *
+ * Create the key whose destructor frees each thread's kept lines.
+ */
+
+static void
+kept_init (void)
+{
+  pthread_key_create (&kept_key, kept_free);
+}
+
+/*
+ * cache_keep:
+ *
+ * Keep a copy of the line fetched for key in database db, which didn't
+ * fit, replacing whatever this thread kept before.
+ */
+
+void
+cache_keep (int db, int type, const char *key, const char *line)
+{
+  if (!kept_registered)
+    {
+      pthread_once (&kept_once, kept_init);
+      kept_registered = (pthread_setspecific (kept_key, kept) == 0);
+    }
+
+  free (kept[db].key);
+  free (kept[db].line);
+
+  kept[db].when = cmdclock ();
+  kept[db].type = type;
+  kept[db].key = strdup (key);
+  kept[db].line = strdup (line);
+
+  if ((kept[db].key == NULL) || (kept[db].line == NULL))
+    {
+      free (kept[db].key);
+      free (kept[db].line);
+      kept[db].key = kept[db].line = NULL;
+    }
+}
+
+/*
+ * cache_kept:
+ *
+ * If this thread kept a line for key in database db, no more than
+ * KEEPTIME milliseconds ago, hand it over as a malloc'd string, to be
+ * freed by the caller, and forget it.  A line kept longer ago is
+ * dropped.  Otherwise returns NULL.
+ */
+
+char *
+cache_kept (int db, int type, const char *key)
+{
+  char *line = kept[db].line;
+
+  if (line == NULL)
+      return NULL;
+
+  if (cmdclock () - kept[db].when > KEEPTIME)
+    {
+      free (kept[db].key);
+      free (kept[db].line);
+      kept[db].key = kept[db].line = NULL;
+      return NULL;
+    }
+
+  if ((kept[db].type != type) || (strcmp (kept[db].key, key) != 0))
+      return NULL;
+
+  free (kept[db].key);
+  kept[db].key = kept[db].line = NULL;
+
+  return line;
+}
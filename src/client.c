@@ -0,0 +1,182 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+
+#include "nss_external.h"
+
+/*
+ * sendall:
+ *
+ * Wait for the nonblocking connect() on fd to complete, and send it the
+ * len bytes of req, giving up at deadline.  Returns 1 on success.
+ */
+
+static int
+sendall (int fd, const char *req, int len, long long deadline)
+{
+  struct pollfd pfd;
+  socklen_t errlen;
+  int n, err, sent = 0;
+
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+
+  while (sent < len)
+    {
+      if (cmdclock () >= deadline)
+	  return 0;
+
+      if ((n = poll (&pfd, 1, (int) (deadline - cmdclock ()))) <= 0)
+	{
+	  if ((n < 0) && (errno != EINTR))
+	      return 0;
+	  continue;
+	}
+
+      errlen = sizeof err;
+      if ((getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+	  || (err != 0))
+	  return 0;
+
+      if ((n = send (fd, req + sent, len - sent, MSG_NOSIGNAL)) < 0)
+	{
+	  if ((errno != EINTR) && (errno != EAGAIN))
+	      return 0;
+	  continue;
+	}
+      sent += n;
+    }
+
+  return 1;
+}
+
+/*
+ * daemon_request:
+ *
+ * Connect to the caching daemon, nss_externald, and send it a request
+ * for name and args.  Each request is one line, "<name> <args>", on a
+ * fresh connection, and is answered in the same way a co-process
+ * answers.  Connecting and sending may take no more than timeout
+ * milliseconds between them.  Returns the connected socket, or -1 if
+ * the daemon isn't running (or is too busy to take the request).
+ */
+
+int
+daemon_request (const char *name, char *const args[], int timeout)
+{
+  const char *path = getconf ()->socket;
+  struct sockaddr_un sun;
+  long long deadline;
+  char req[CMDSIZ];
+  int fd, len, n;
+
+  len = snprintf (req, sizeof req, "%s ", name);
+  if ((len >= CMDSIZ)
+      || ((n = cmdjoin (args, req + len, sizeof req - len - 1)) < 0))
+      return -1;
+
+  len += n;
+  req[len++] = '\n';
+
+  memset (&sun, 0, sizeof sun);
+  sun.sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof sun.sun_path)
+      return -1;
+  strcpy (sun.sun_path, path);
+
+  if ((fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		    0)) < 0)
+      return -1;
+
+  deadline = cmdclock () + timeout;
+
+  /*
+   * A daemon whose listen queue is full refuses the connection with
+   * EAGAIN, rather than making us wait; treat that as not running.
+   * Once the request is sent, callers expect an ordinary blocking
+   * socket.
+   */
+
+  if (((connect (fd, (struct sockaddr *) &sun, sizeof sun) < 0)
+       && (errno != EINPROGRESS))
+      || !sendall (fd, req, len, deadline)
+      || (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK) < 0))
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/*
+ * daemon_connect:
+ *
+ * Ask the daemon for the output of the command for database db and
+ * args, as for daemon_request().
+ */
+
+int
+daemon_connect (int db, char *const args[])
+{
+  return daemon_request (dbnames[db], args, cmdtimeout (db));
+}
+
+/*
+ * daemon_query:
+ *
+ * Ask the daemon for the output of the command for database db and args.
+ *
+ * Returns 0 if the daemon isn't running, in which case the caller
+ * should run the command itself.  Otherwise returns 1, with *filep set
+ * to the reply, or NULL if the daemon couldn't (or wouldn't) answer.
+ */
+
+int
+daemon_query (int db, char *const args[], char ***filep)
+{
+  int fd;
+
+  *filep = NULL;
+
+  if ((fd = daemon_connect (db, args)) < 0)
+      return 0;
+
+  /*
+   * The daemon gives the command the same time we would, so allow it
+   * a little longer than that.
+   */
+
+  *filep = cmdreply (fd, cmdtimeout (db) + DAEMONSLACK);
+  close (fd);
+
+  return 1;
+}
@@ -0,0 +1,286 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "nss_external.h"
+
+const char *const dbnames[NDB] = { "passwd", "group", "shadow" };
+
+/*
+ * The configuration file is read the first time it's needed, and again
+ * whenever its modification time changes, checking no more than once a
+ * second.  Each reading produces a new struct conf; the old ones are
+ * never freed, since other threads may still be looking at them.
+ *
+ * The file is made up of "keyword value" lines.  Blank lines, and
+ * anything following a '#', are ignored, as are unknown keywords.
+ */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct conf *current = NULL;
+static time_t checked = 0;
+static struct timespec mtime;
+static int exists = 0;
+
+/*
+ * Defaults from nss_external.h
+ */
+
+static struct conf defaults = {
+  MODE, MINUID, MINGID, MAXOUTPUT, SNAPSHOT_MAXAGE, SOCKETPATH, SHMPATH,
+  SNAPDIR,
+  {
+    { PASSWDCMD, PASSWD_TIMEOUT, PASSWD_CACHESIZ, PASSWD_TTL, PASSWD_NEGTTL,
+      PASSWD_MAXSTALE, BATCH, PREFETCH, MAXPROCS, QUEUE, WORKERS, 0 },
+    { GROUPCMD,  GROUP_TIMEOUT,  GROUP_CACHESIZ,  GROUP_TTL,  GROUP_NEGTTL,
+      GROUP_MAXSTALE, BATCH, PREFETCH, MAXPROCS, QUEUE, WORKERS, MEMBER },
+    { SHADOWCMD, SHADOW_TIMEOUT, SHADOW_CACHESIZ, SHADOW_TTL, SHADOW_NEGTTL,
+      SHADOW_MAXSTALE, 1, PREFETCH, MAXPROCS, QUEUE, WORKERS, 0 },
+  }
+};
+
+/*
+ * number:
+ *
+ * Parse a non-negative number, returning -1 if it isn't one.
+ */
+
+static long
+number (const char *value)
+{
+  char *end;
+  long l;
+
+  if (!isdigit ((unsigned char) *value))
+      return -1;
+
+  l = strtol (value, &end, 10);
+
+  return (*end == '\0') ? l : -1;
+}
+
+/*
+ * setting:
+ *
+ * Apply a single "keyword value" setting.  Per database settings are
+ * written "<database>_<setting>", such as "passwd_timeout".
+ */
+
+static void
+setting (struct conf *c, const char *key, const char *value)
+{
+  long n = number (value);
+  char *command, *path;
+  size_t len;
+  int db;
+
+  if (strcmp (key, "mode") == 0)
+    {
+      if ((strcmp (value, "spawn") == 0) || (strcmp (value, "popen") == 0))
+	  c->mode = MODE_SPAWN;
+      else if (strcmp (value, "coprocess") == 0)
+	  c->mode = MODE_COPROCESS;
+      else if (strcmp (value, "daemon") == 0)
+	  c->mode = MODE_DAEMON;
+      return;
+    }
+
+  if ((strcmp (key, "minuid") == 0) && (n >= 0))
+      c->minuid = (uid_t) n;
+  else if ((strcmp (key, "mingid") == 0) && (n >= 0))
+      c->mingid = (gid_t) n;
+  else if ((strcmp (key, "maxoutput") == 0) && (n > 0))
+      c->maxoutput = (size_t) n;
+  else if ((strcmp (key, "snapshot_maxage") == 0) && (n >= 0))
+      c->snapmaxage = (time_t) n;
+  else if ((strcmp (key, "socket_path") == 0) && (*value == '/'))
+    {
+      if ((path = strdup (value)) != NULL)
+	  c->socket = path;
+    }
+  else if ((strcmp (key, "shm_path") == 0) && (*value == '/'))
+    {
+      if ((path = strdup (value)) != NULL)
+	  c->shmpath = path;
+    }
+  else if ((strcmp (key, "snapshot_dir") == 0) && (*value == '/'))
+    {
+      if ((path = strdup (value)) != NULL)
+	  c->snapdir = path;
+    }
+
+  for (db = 0; db < NDB; db++)
+    {
+      struct dbconf *d = &c->db[db];
+
+      len = strlen (dbnames[db]);
+      if ((strncmp (key, dbnames[db], len) != 0) || (key[len] != '_'))
+	  continue;
+      key += len + 1;
+
+      if ((strcmp (key, "command") == 0) && (*value == '/'))
+	{
+	  if ((command = strdup (value)) != NULL)
+	      d->command = command;
+	}
+      else if ((strcmp (key, "timeout") == 0) && (n > 0))
+	  d->timeout = (int) n;
+      else if ((strcmp (key, "cachesize") == 0) && (n >= 0))
+	  d->cachesize = (size_t) n;
+      else if ((strcmp (key, "ttl") == 0) && (n >= 0))
+	  d->ttl = (time_t) n;
+      else if ((strcmp (key, "negttl") == 0) && (n >= 0))
+	  d->negttl = (time_t) n;
+      else if ((strcmp (key, "maxstale") == 0) && (n >= 0))
+	  d->maxstale = (time_t) n;
+      else if ((strcmp (key, "batch") == 0) && (n > 0) && (db != DB_SHADOW))
+	  d->batch = (n > MAXBATCH) ? MAXBATCH : (int) n;
+      else if ((strcmp (key, "prefetch") == 0) && (n >= 0))
+	  d->prefetch = (n != 0);
+      else if ((strcmp (key, "maxprocs") == 0) && (n >= 0))
+	  d->maxprocs = (int) n;
+      else if ((strcmp (key, "queue") == 0) && (n >= 0))
+	  d->queue = (int) n;
+      else if ((strcmp (key, "workers") == 0) && (n > 0))
+	  d->workers = (n > MAXWORKERS) ? MAXWORKERS : (int) n;
+      else if ((strcmp (key, "member") == 0) && (n >= 0) && (db == DB_GROUP))
+	  d->member = (n != 0);
+      return;
+    }
+}
+
+/*
+ * load:
+ *
+ * Read the configuration file into a new struct conf.
+ */
+
+static struct conf *
+load (const char *file)
+{
+  struct conf *c;
+  char *line = NULL, *key, *value, *p;
+  size_t size = 0;
+  FILE *fp;
+
+  if ((c = malloc (sizeof (struct conf))) == NULL)
+      return NULL;
+
+  *c = defaults;
+
+  if ((fp = fopen (file, "re")) == NULL)
+      return c;
+
+  while (getline (&line, &size, fp) >= 0)
+    {
+      if ((p = strchr (line, '#')) != NULL)
+	  *p = '\0';
+
+      key = line + strspn (line, " \t\n");
+      value = key + strcspn (key, " \t\n");
+      if (*value != '\0')
+	  *value++ = '\0';
+      value += strspn (value, " \t");
+      value[strcspn (value, " \t\n")] = '\0';
+
+      if ((*key != '\0') && (*value != '\0'))
+	  setting (c, key, value);
+    }
+
+  free (line);
+  fclose (fp);
+
+  return c;
+}
+
+/*
+ * getconf:
+ *
+ * Return the current configuration.  NSS_EXTERNAL_CONF may name another
+ * file to read instead, for testing, except in setuid programs.
+ */
+
+const struct conf *
+getconf (void)
+{
+  struct conf *c;
+  struct stat sb;
+  time_t t = cache_now ();
+  const char *file;
+  int found;
+
+  c = __atomic_load_n (&current, __ATOMIC_ACQUIRE);
+  if ((c != NULL) && (__atomic_load_n (&checked, __ATOMIC_RELAXED) == t))
+      return c;
+
+  pthread_mutex_lock (&lock);
+
+  if ((current == NULL) || (checked != t))
+    {
+      if ((file = secure_getenv (CONFENV)) == NULL)
+	  file = CONFFILE;
+
+      found = (stat (file, &sb) == 0);
+
+      if ((current == NULL) || (found != exists)
+	  || (found && ((sb.st_mtim.tv_sec != mtime.tv_sec)
+			|| (sb.st_mtim.tv_nsec != mtime.tv_nsec))))
+	{
+	  if ((c = load (file)) != NULL)
+	      __atomic_store_n (&current, c, __ATOMIC_RELEASE);
+
+	  exists = found;
+	  if (found)
+	      mtime = sb.st_mtim;
+	}
+
+      __atomic_store_n (&checked, t, __ATOMIC_RELAXED);
+    }
+
+  c = (current != NULL) ? current : &defaults;
+
+  pthread_mutex_unlock (&lock);
+
+  return c;
+}
+
+/*
+ * conf_fork:
+ *
+ * Hold the lock across a fork(), as for pool_fork().
+ */
+
+void
+conf_fork (int stage)
+{
+  if (stage == FORK_PREPARE)
+      pthread_mutex_lock (&lock);
+  else
+      pthread_mutex_unlock (&lock);
+}
@@ -0,0 +1,300 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "nss_external.h"
+
+/*
+ * Co-process mode.
+ *
+ * Rather than running the command once per lookup, start it once with
+ * the single argument "--coprocess", and keep it running.  Each request
+ * is written to its stdin as a line containing the argument we would
+ * otherwise have passed on the command line (an empty line asks for
+ * all entries).  The command answers on stdout with zero or more
+ * entries, followed by an empty line.
+ *
+ * Each database has a pool of up to the configured number of workers,
+ * co-processes each answering one request at a time.  Lookups take
+ * whichever worker is idle, starting it if need be, and wait in line
+ * when all are busy.
+ *
+ * If a co-process dies, or doesn't answer in time, it's restarted.
+ * If it can't be started, or fails again straight away (say, because it
+ * doesn't understand the protocol), co-process mode is abandoned for
+ * that command for COPROCRETRY seconds, and cmdopen() falls back to
+ * running the command.  If the configured command changes, the old one
+ * is stopped and the new one given a chance straight away.
+ */
+
+struct coproc
+{
+  const char *command;		/* command running */
+  pid_t pid;
+  pid_t owner;			/* process which started the co-process */
+  int fd;
+  int busy;
+};
+
+struct coprocs
+{
+  pthread_mutex_t lock;		/* for everything but a busy worker */
+  struct pool pool;
+  const char *command;		/* command last tried */
+  pid_t owner;			/* process the busy flags belong to */
+  int broken;
+  time_t retry;			/* when to try again, if broken */
+  struct coproc workers[MAXWORKERS];
+};
+
+#define COPROCS_INITIALIZER \
+	{ PTHREAD_MUTEX_INITIALIZER, POOL_INITIALIZER, NULL, 0, 0, 0 }
+
+static struct coprocs coprocs[NDB] = {
+  COPROCS_INITIALIZER, COPROCS_INITIALIZER, COPROCS_INITIALIZER
+};
+
+/*
+ * stop:
+ *
+ * Shut down a co-process.  It's killed outright, rather than asked to
+ * exit, so that one which ignores SIGTERM can't hang the lookup waiting
+ * for it.  If we've forked since it was started, it belongs to our
+ * parent, so simply forget about it.
+ */
+
+static void
+stop (struct coproc *cp)
+{
+  if (cp->pid > 0)
+    {
+      close (cp->fd);
+
+      if (cp->owner == getpid ())
+	{
+	  kill (cp->pid, SIGKILL);
+	  while ((waitpid (cp->pid, NULL, 0) < 0) && (errno == EINTR));
+	}
+    }
+
+  cp->fd = -1;
+  cp->pid = 0;
+}
+
+/*
+ * start:
+ *
+ * Start the co-process.
+ */
+
+static int
+start (struct coproc *cp, const char *command)
+{
+  char *argv[] = { (char *) command, COPROCARG, NULL };
+
+  cp->command = command;
+
+  if ((cp->pid = cmdspawn (command, argv, 1, &cp->fd)) < 0)
+    {
+      cp->pid = 0;
+      return 0;
+    }
+
+  cp->owner = getpid ();
+
+  return 1;
+}
+
+/*
+ * exchange:
+ *
+ * Send a request, and collect the response up to the terminating
+ * empty line.  Returns NULL if the co-process went away.
+ */
+
+static char **
+exchange (struct coproc *cp, int db, const char *arg)
+{
+  size_t len = strlen (arg);
+
+  if ((send (cp->fd, arg, len, MSG_NOSIGNAL) != (ssize_t) len)
+      || (send (cp->fd, "\n", 1, MSG_NOSIGNAL) != 1))
+      return NULL;
+
+  return cmdreply (cp->fd, cmdtimeout (db));
+}
+
+/*
+ * take:
+ *
+ * Pick an idle worker, from the first n, and mark it busy.  Idle
+ * workers beyond the first n, left over from a larger configuration,
+ * are stopped.  Returns NULL if co-process mode has been abandoned for
+ * command, and it isn't yet time to try again.  Called with the lock
+ * held.
+ */
+
+static struct coproc *
+take (struct coprocs *cs, const char *command, int n)
+{
+  struct coproc *cp = NULL;
+  int i;
+
+  if ((cs->command == NULL) || (strcmp (cs->command, command) != 0))
+    {
+      cs->command = command;
+      cs->broken = 0;
+    }
+
+  /*
+   * After a fork, the workers our parent's threads were using are no
+   * longer in use here.
+   */
+
+  if (cs->owner != getpid ())
+    {
+      cs->owner = getpid ();
+      for (i = 0; i < MAXWORKERS; i++)
+	  cs->workers[i].busy = 0;
+    }
+
+  for (i = MAXWORKERS - 1; i >= 0; i--)
+    {
+      if (cs->workers[i].busy)
+	  continue;
+
+      if (i >= n)
+	  stop (&cs->workers[i]);
+      else if ((cp == NULL) || (cs->workers[i].pid > 0))
+	  cp = &cs->workers[i];
+    }
+
+  if (cs->broken)
+    {
+      if (cache_now () < cs->retry)
+	  return NULL;
+      cs->broken = 0;
+    }
+
+  if (cp != NULL)
+      cp->busy = 1;
+
+  return cp;
+}
+
+/*
+ * coproc_query:
+ *
+ * Ask a co-process for database db for the entries matching args.
+ * Returns NULL if co-process mode isn't working for this command, or
+ * every worker stayed busy too long.
+ */
+
+char **
+coproc_query (int db, char *const args[])
+{
+  const struct dbconf *d = &getconf ()->db[db];
+  struct coprocs *cs = &coprocs[db];
+  struct coproc *cp;
+  char **file = NULL;
+  char arg[CMDSIZ];
+  int tries;
+
+  /*
+   * The protocol is line based, so an argument with a newline in it
+   * can't be sent.
+   */
+
+  if (cmdjoin (args, arg, sizeof arg) < 0)
+      return NULL;
+
+  if (!pool_enter (&cs->pool, d->workers, d->queue, d->timeout))
+      return NULL;
+
+  pthread_mutex_lock (&cs->lock);
+  cp = take (cs, d->command, d->workers);
+  pthread_mutex_unlock (&cs->lock);
+
+  if (cp == NULL)
+    {
+      pool_leave (&cs->pool);
+      return NULL;
+    }
+
+  for (tries = 0; (file == NULL) && (tries < 2); tries++)
+    {
+      if ((cp->pid == 0) || (cp->owner != getpid ())
+	  || (strcmp (cp->command, d->command) != 0))
+	{
+	  stop (cp);
+	  if (!start (cp, d->command))
+	      break;
+	}
+
+      if ((file = exchange (cp, db, arg)) == NULL)
+	  stop (cp);
+    }
+
+  pthread_mutex_lock (&cs->lock);
+  if ((file == NULL) && (cs->command != NULL)
+      && (strcmp (cs->command, d->command) == 0))
+    {
+      cs->broken = 1;
+      cs->retry = cache_now () + COPROCRETRY;
+    }
+  cp->busy = 0;
+  pthread_mutex_unlock (&cs->lock);
+
+  pool_leave (&cs->pool);
+
+  return file;
+}
+
+/*
+ * coproc_fork:
+ *
+ * Hold the locks across a fork(), as for pool_fork().
+ */
+
+void
+coproc_fork (int stage)
+{
+  int db;
+
+  for (db = 0; db < NDB; db++)
+    {
+      if (stage == FORK_PREPARE)
+	  pthread_mutex_lock (&coprocs[db].lock);
+      pool_fork (&coprocs[db].pool, stage);
+      if (stage != FORK_PREPARE)
+	  pthread_mutex_unlock (&coprocs[db].lock);
+    }
+}
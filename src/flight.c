@@ -0,0 +1,176 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "nss_external.h"
+
+/*
+ * Single flight lookups.
+ *
+ * The first thread to miss the cache for a key joins an empty flight,
+ * and becomes its leader: it runs the command, and lands the flight
+ * with the answer.  Threads joining while it's in the air wait for it
+ * to land, and take a copy of the answer.  Landed flights leave the
+ * list straight away, and are freed by the last thread out.
+ *
+ * A flight started before a fork() will never land in the child, so
+ * the child drops it and starts its own.
+ */
+
+static struct flight *
+find (struct flights *fs, int type, const char *key)
+{
+  struct flight **fp, *f;
+
+  for (fp = &fs->list; (f = *fp) != NULL; fp = &f->next)
+      if ((f->type == type) && (strcmp (f->key, key) == 0))
+	{
+	  if (f->owner == getpid ())
+	      return f;
+
+	  *fp = f->next;
+	  return NULL;
+	}
+
+  return NULL;
+}
+
+static void
+release (struct flight *f)
+{
+  pthread_cond_destroy (&f->cond);
+  free (f->key);
+  free (f->line);
+  free (f);
+}
+
+/*
+ * flight_join:
+ *
+ * If a lookup for key is already in flight, wait for it, and return 1
+ * with *linep set to a malloc'd copy of its answer: the entry, "" if
+ * there wasn't one, or NULL if the command couldn't be run.  Otherwise
+ * return 0; the caller should do the lookup, and then flight_land().
+ */
+
+int
+flight_join (struct flights *fs, int type, const char *key, char **linep)
+{
+  struct flight *f;
+
+  *linep = NULL;
+
+  pthread_mutex_lock (&fs->lock);
+
+  if ((f = find (fs, type, key)) != NULL)
+    {
+      f->waiters++;
+      while (!f->landed)
+	  pthread_cond_wait (&f->cond, &fs->lock);
+
+      if (f->line != NULL)
+	  *linep = strdup (f->line);
+
+      if (--f->waiters == 0)
+	  release (f);
+
+      pthread_mutex_unlock (&fs->lock);
+      STAT (STAT_SHARED);
+      return 1;
+    }
+
+  /*
+   * If we can't take off, the lookup simply isn't shared.
+   */
+
+  if ((f = calloc (1, sizeof (struct flight))) != NULL)
+    {
+      if ((f->key = strdup (key)) == NULL)
+	  free (f);
+      else
+	{
+	  f->type = type;
+	  f->owner = getpid ();
+	  pthread_cond_init (&f->cond, NULL);
+	  f->next = fs->list;
+	  fs->list = f;
+	}
+    }
+
+  pthread_mutex_unlock (&fs->lock);
+
+  return 0;
+}
+
+/*
+ * flight_land:
+ *
+ * Hand the answer to a lookup joined with flight_join() to any threads
+ * waiting for it.  line is as flight_join() returns it.
+ */
+
+void
+flight_land (struct flights *fs, int type, const char *key, const char *line)
+{
+  struct flight **fp, *f;
+
+  pthread_mutex_lock (&fs->lock);
+
+  for (fp = &fs->list; (f = *fp) != NULL; fp = &f->next)
+      if ((f->type == type) && (strcmp (f->key, key) == 0)
+	  && (f->owner == getpid ()))
+	{
+	  *fp = f->next;
+
+	  if (line != NULL)
+	      f->line = strdup (line);
+	  f->landed = 1;
+
+	  if (f->waiters == 0)
+	      release (f);
+	  else
+	      pthread_cond_broadcast (&f->cond);
+	  break;
+	}
+
+  pthread_mutex_unlock (&fs->lock);
+}
+
+/*
+ * flight_fork:
+ *
+ * Hold the lock across a fork(), as for pool_fork().  The flights in the
+ * air are left for find() to drop in the child.
+ */
+
+void
+flight_fork (struct flights *fs, int stage)
+{
+  if (stage == FORK_PREPARE)
+      pthread_mutex_lock (&fs->lock);
+  else
+      pthread_mutex_unlock (&fs->lock);
+}
@@ -26,36 +26,36 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "nss_external.h"
 
 /*
- * Needed for getgrent() statefulness.
+ * Needed for getgrent() statefulness.  The lock keeps threads
+ * enumerating at the same time from treading on each other.
  */
 
-static char **proc = NULL;
-static char **gproc;
+static struct stream *stream = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * buffer_to_grstruct:
  *
  * Given a buffer containing a single group(5) line, populate a
- * group struct.  Note that the ':' in the buffer are converted
- * to '\0' by the call to split.
+ * group struct.  The line is copied into the caller's buffer, and the
+ * ':' and ',' in the copy are converted to '\0' as it's parsed.
  */
 
-static enum nss_status
+enum nss_status
 buffer_to_grstruct (struct group *grstruct, char *newbuf, char *buffer,
 		    size_t buflen, int *errnop)
 {
-  char **array;
-  size_t count;
-  size_t loop;
-  char *c;
-  char *bufstart;
-  char *groupmembers;
-  char **arraystart = (char **) buffer;
-  size_t offset;
+  char *fields[4];
+  char **members;
+  char *text, *c;
+  size_t len, count = 0;
+  id_t gid;
 
   if (grstruct == NULL)
     {
@@ -67,203 +67,450 @@ buffer_to_grstruct (struct group *grstruct, char *newbuf, char *buffer,
   /*
    * Here's how we'll lay out our buffer:
    *
-   * +---------------+----------+-------+-------+----------------------------+
-   * | array of char | grname\0 | pwd\0 | gid\0 | grp membs terminated by \0 |
-   * | pointers into |          |       |       |                            |
-   * | grp memb with |          |       |       |                            |
-   * | \0 term.      |          |       |       |                            |
-   * +---------------+----------+-------+-------+----------------------------+
+   * +---------------+-----------+----------+-------+-------+--------------+
+   * | array of char | (unused)  | grname\0 | pwd\0 | gid\0 | grp membs    |
+   * | pointers into |           |          |       |       | separated    |
+   * | grp memb with |           |          |       |       | by \0        |
+   * | NULL term.    |           |          |       |       |              |
+   * +---------------+-----------+----------+-------+-------+--------------+
+   *
+   * The line goes at the end of the buffer, so that the member array
+   * can be filled in from the start in the same pass that finds the
+   * members, without counting them first.
    */
 
-  /*
-   * First, count # of ','s in the alloc'd buffer, so we know how
-   * much space for the char * array we need to reserve. Start off
-   * with a minimum size of 2, since if we find no ','s, it may mean
-   * we have one group member, and we need a NULL for a terminator.
-   */
+  members = (char **) (((uintptr_t) buffer + sizeof (char *) - 1)
+		       & ~(uintptr_t) (sizeof (char *) - 1));
 
-  count = 2;
+  len = strlen (newbuf);
 
-  for (c = newbuf; *c != '\0'; c++)
-      if (*c == ',')
-	  count++;
+  if ((char *) (members + 1) + len + 1 > buffer + buflen)
+    {
+      STAT (STAT_ERANGE);
+      *errnop = ERANGE;
+      return NSS_STATUS_TRYAGAIN;
+    }
+
+  text = buffer + buflen - len - 1;
+  memcpy (text, newbuf, len + 1);
 
   /*
-   * So, we need to reserve (size of char ptr) * count
-   * bytes at the beginning of the buffer.
+   * sanity check: we should have 4 fields, and a numeric gid.  If not,
+   * not a valid group entry, so return NOTFOUND.
    */
 
-  offset = count * sizeof (char *);
-  bufstart = buffer + offset;
+  if ((splitfields (text, fields, 4) != 4) || !parseid (fields[2], &gid))
+    {
+      STAT (STAT_PARSEFAIL);
+      *errnop = ENOENT;
+      return NSS_STATUS_NOTFOUND;
+    }
 
   /*
-   * Enough space?
+   * Split the members on ',', filling in the array as we go, as long
+   * as there's room left for the terminating NULL.
    */
 
-  if ((offset + strlen (newbuf) + 1) > buflen)
+  for (c = fields[3]; *c != '\0'; c++)
     {
-      *errnop = ERANGE;
-      return NSS_STATUS_TRYAGAIN;
+      if (*c == ',')
+	{
+	  *c = '\0';
+	  continue;
+	}
+
+      if ((c == fields[3]) || (c[-1] == '\0'))
+	{
+	  if ((char *) (members + count + 2) > text)
+	    {
+	      STAT (STAT_ERANGE);
+	      *errnop = ERANGE;
+	      return NSS_STATUS_TRYAGAIN;
+	    }
+	  members[count++] = c;
+	}
     }
 
+  members[count] = NULL;
+
   /*
-   * copy buffer into new location
+   * Populate the grstruct
    */
 
-  strcpy (bufstart, newbuf);
+  grstruct->gr_name   = fields[0];
+  grstruct->gr_passwd = fields[1];
+  grstruct->gr_gid    = (gid_t) gid;
+  grstruct->gr_mem    = members;
 
-  /*
-   * Initialize arraystart to null pointers
-   */
+  return NSS_STATUS_SUCCESS;
+}
 
-  for (loop = 0; loop < count; loop++)
-      arraystart[loop] = NULL;
+/*
+ * _nss_external_getgrgid_r
+ */
 
-  /*
-   * split on ':'
-   */
+enum nss_status
+_nss_external_getgrgid_r (gid_t gid, struct group *result, char *buffer,
+			  size_t buflen, int *errnop)
+{
+  char arg[CMDSIZ];
 
-  array = split (bufstart, ":");
+  CHECKDISABLED;
+  STAT (STAT_GETGRGID);
 
-  if (array == NULL)
-    {
-      /* couldn't split on the buffer */
-      *errnop = EAGAIN;
-      return NSS_STATUS_TRYAGAIN;
-    }
+  if (gid < getconf ()->mingid)
+      return NSS_STATUS_NOTFOUND;
 
   /*
-   * sanity check: we should have 4 fields.  If not, not a valid group entry,
-   * so return NOTFOUND.
+   * Will the arg overflow?
    */
 
-  for (loop = 0; array[loop] != NULL; loop++);
-
-  if (loop != 4)
+  if (snprintf (arg, CMDSIZ, "%u", (unsigned) gid) >= CMDSIZ)
     {
-      free (array);
       *errnop = ENOENT;
-      return NSS_STATUS_NOTFOUND;
+      return NSS_STATUS_UNAVAIL;
     }
 
-  /*
-   * Populate the grstruct
-   */
+  return lookup_key (DB_GROUP, CACHE_ID, arg, result, buffer, buflen,
+		     errnop);
+}
 
-  grstruct->gr_name   = array[0];
-  grstruct->gr_passwd = array[1];
-  grstruct->gr_gid    = (gid_t) atoi (array[2]);
-  grstruct->gr_mem    = arraystart;
-  groupmembers        = array[3];
+/*
+ * _nss_external_getgrnam_r
+ */
 
-  free (array);
+enum nss_status
+_nss_external_getgrnam_r (const char *name, struct group *result,
+			  char *buffer, size_t buflen, int *errnop)
+{
+  CHECKDISABLED;
+  STAT (STAT_GETGRNAM);
 
-  /*
-   * groupmembers now contains the list
-   * of comma separated group members.
-   * Re split on ','
-   */
+  return lookup_key (DB_GROUP, CACHE_NAME, (char *) name, result, buffer,
+		     buflen, errnop);
+}
 
-  array = split (groupmembers, ",");
+/*
+ * Reverse membership index, used by initgroups when the command doesn't
+ * answer "--member" queries.  It's built from a single enumeration, and
+ * holds one (user, gid) pair per group membership, sorted by user.  The
+ * user names point into the enumeration's output, which is kept.
+ */
 
-  if (array == NULL)
+struct membership
+{
+  const char *user;
+  gid_t gid;
+};
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **index_proc = NULL;
+static struct membership *index_members = NULL;
+static size_t index_count = 0;
+static time_t index_expires = 0;
+
+static int
+membership_cmp (const void *a, const void *b)
+{
+  return strcmp (((const struct membership *) a)->user,
+		 ((const struct membership *) b)->user);
+}
+
+/*
+ * index_build:
+ *
+ * Enumerate the group database, and rebuild the index from it.
+ * Called with index_lock held.
+ */
+
+static int
+index_build (void)
+{
+  struct membership *members = NULL, *tmp;
+  size_t count = 0, size = 0;
+  char **proc, **pp;
+
+  if ((proc = cmdopen (DB_GROUP, NOARGS)) == NULL)
+      return 0;
+
+  for (pp = proc; *pp != NULL; pp++)
     {
-      /* couldn't split on the buffer */
-      *errnop = EAGAIN;
-      return NSS_STATUS_TRYAGAIN;
+      char *line = *pp;
+      char *gid, *users, *user;
+      id_t id;
+
+      strsep (&line, ":");	/* name */
+      strsep (&line, ":");	/* password */
+      gid = strsep (&line, ":");
+      users = strsep (&line, ":");
+
+      if ((users == NULL) || (line != NULL) || !parseid (gid, &id)
+	  || (id < getconf ()->mingid))
+	  continue;
+
+      while ((user = strsep (&users, ",")) != NULL)
+	{
+	  if (*user == '\0')
+	      continue;
+
+	  if (count == size)
+	    {
+	      size = size ? size * 2 : 1024;
+	      if ((tmp = realloc (members, size * sizeof *members)) == NULL)
+		{
+		  free (members);
+		  cmdclose (proc);
+		  return 0;
+		}
+	      members = tmp;
+	    }
+
+	  members[count].user = user;
+	  members[count].gid = (gid_t) id;
+	  count++;
+	}
     }
 
+  qsort (members, count, sizeof *members, membership_cmp);
+
+  cmdclose (index_proc);
+  free (index_members);
+
+  index_proc = proc;
+  index_members = members;
+  index_count = count;
+  index_expires = cache_now () + getconf ()->db[DB_GROUP].ttl;
+
+  return 1;
+}
+
+/*
+ * index_gids:
+ *
+ * Return a malloc'd, space separated list of the gids of the groups
+ * user is a member of, from the index.  Returns NULL if the index
+ * couldn't be built.
+ */
+
+static char *
+index_gids (const char *user)
+{
+  size_t lo = 0, hi, i;
+  char *gids, *p;
+
+  pthread_mutex_lock (&index_lock);
+
+  if ((index_proc == NULL) || (index_expires <= cache_now ()))
+      if (!index_build ())
+	{
+	  pthread_mutex_unlock (&index_lock);
+	  return NULL;
+	}
+
   /*
-   * Copy array into the space reserved in the
-   * buffer.  Make sure to NULL terminate at the end.
+   * Find the first pair for user, and count how many there are.
    */
 
-  for (loop = 0; array[loop] != NULL; loop++)
-      arraystart[loop] = array[loop];
+  for (hi = index_count; lo < hi;)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (strcmp (index_members[mid].user, user) < 0)
+	  lo = mid + 1;
+      else
+	  hi = mid;
+    }
 
-  free (array);
+  for (hi = lo; hi < index_count; hi++)
+      if (strcmp (index_members[hi].user, user) != 0)
+	  break;
 
-  return NSS_STATUS_SUCCESS;
+  if ((gids = malloc ((hi - lo) * 12 + 1)) != NULL)
+    {
+      for (p = gids, i = lo; i < hi; i++)
+	  p += sprintf (p, "%u ", (unsigned) index_members[i].gid);
+      *p = '\0';
+    }
+
+  pthread_mutex_unlock (&index_lock);
+
+  return gids;
 }
 
 /*
- * search:
+ * member_gids:
  *
- * When passed a command, get the result and populate.
+ * Return a malloc'd, space separated list of the gids of the groups in
+ * proc that user is a member of.
  */
 
-static enum nss_status
-search (char *command, char *arg, struct group *result, char *buffer,
-	size_t buflen, int *errnop)
+static char *
+member_gids (char **proc, const char *user)
 {
-  char **proc;
-  enum nss_status status;
+  char **pp, *gids, *p;
+  size_t count;
 
-  *errnop = 0;
+  for (count = 0; proc[count] != NULL; count++);
 
-  proc = cmdopen (command, arg);
+  if ((gids = malloc (count * 12 + 1)) == NULL)
+      return NULL;
 
-  CHECKUNAVAIL(proc);
-  CHECKLAST(proc[0]);
+  for (p = gids, pp = proc; *pp != NULL; pp++)
+    {
+      char *copy, *line, *gid, *users, *member;
+      id_t id;
+
+      if ((copy = line = strdup (*pp)) == NULL)
+	  continue;
+
+      strsep (&line, ":");	/* name */
+      strsep (&line, ":");	/* password */
+      gid = strsep (&line, ":");
+      users = strsep (&line, ":");
+
+      if ((users != NULL) && (line == NULL) && parseid (gid, &id))
+	  while ((member = strsep (&users, ",")) != NULL)
+	      if (strcmp (member, user) == 0)
+		{
+		  p += sprintf (p, "%u ", (unsigned) id);
+		  break;
+		}
+
+      free (copy);
+    }
 
-  status = buffer_to_grstruct (result, proc[0], buffer, buflen, errnop);
-  cmdclose (proc);
+  *p = '\0';
 
-  return status;
+  return gids;
 }
 
 /*
- * _nss_external_getgrgid_r
+ * addgroup:
+ *
+ * Append gid to the caller's groups, growing the array if need be, but
+ * never past limit (if limit is positive).  Returns 0 if there's no room,
+ * or -1 if the array couldn't be grown.
  */
 
-enum nss_status
-_nss_external_getgrgid_r (gid_t gid, struct group *result, char *buffer,
-			  size_t buflen, int *errnop)
+static int
+addgroup (gid_t gid, long int *start, long int *size, gid_t **groupsp,
+	  long int limit)
 {
-  char arg[CMDSIZ];
+  gid_t *groups = *groupsp;
+  long int i, newsize;
 
-  CHECKDISABLED;
+  for (i = 0; i < *start; i++)
+      if (groups[i] == gid)
+	  return 1;
 
-  if (gid < MINGID)
-      return NSS_STATUS_NOTFOUND;
+  if (*start == *size)
+    {
+      if ((limit > 0) && (*size >= limit))
+	  return 0;
 
-  /*
-   * Will the arg overflow?
-   */
+      newsize = *size ? *size * 2 : 16;
+      if ((limit > 0) && (newsize > limit))
+	  newsize = limit;
 
-  if (snprintf (arg, CMDSIZ, "%d", gid) >= CMDSIZ)
-    {
-      *errnop = ENOENT;
-      return NSS_STATUS_UNAVAIL;
+      if ((groups = realloc (groups, newsize * sizeof (gid_t))) == NULL)
+	  return -1;
+
+      *groupsp = groups;
+      *size = newsize;
     }
 
-  return search (GROUPCMD, arg, result, buffer, buflen, errnop);
+  groups[(*start)++] = gid;
+
+  return 1;
 }
 
 /*
- * _nss_external_getgrnam_r
+ * _nss_external_initgroups_dyn
+ *
+ * Asks the group command for the user's groups with "--member user".
+ * If that doesn't produce anything (the command may not understand
+ * it), the groups are found in the reverse membership index instead.
  */
 
 enum nss_status
-_nss_external_getgrnam_r (const char *name, struct group *result,
-			  char *buffer, size_t buflen, int *errnop)
+_nss_external_initgroups_dyn (const char *user, gid_t group, long int *start,
+			      long int *size, gid_t **groupsp, long int limit,
+			      int *errnop)
 {
-  enum nss_status status;
+  enum nss_status status = NSS_STATUS_NOTFOUND;
+  char *args[] = { MEMBERARG, (char *) user, NULL };
+  char **proc;
+  char *gids, *p, *end;
+  gid_t gid;
+  int member, added;
 
   CHECKDISABLED;
+  STAT (STAT_INITGROUPS);
 
   *errnop = 0;
 
-  status = search (GROUPCMD, (char *) name, result, buffer, buflen, errnop);
+  if (!validkey (user))
+    {
+      *errnop = ENOENT;
+      return NSS_STATUS_NOTFOUND;
+    }
+
+  if (!cache_get (&lookups[DB_GROUP].cache, CACHE_MEMBER, user, &gids))
+    {
+      /*
+       * Unless the command is known to understand --member, an empty
+       * answer may just mean it doesn't, so list every group instead.
+       */
+
+      member = getconf ()->db[DB_GROUP].member;
+      proc = cmdopen (DB_GROUP, args);
+      gids = ((proc != NULL) && (member || (proc[0] != NULL)))
+	     ? member_gids (proc, user) : NULL;
+      cmdclose (proc);
+
+      if ((gids == NULL) || (!member && (*gids == '\0')))
+	{
+	  free (gids);
+	  gids = index_gids (user);
+	}
 
-  if (status == NSS_STATUS_SUCCESS)
-      if (result->gr_gid < MINGID)
-	  return NSS_STATUS_NOTFOUND;
+      CHECKUNAVAIL(gids);
+
+      cache_put (&lookups[DB_GROUP].cache, CACHE_MEMBER, user, gids);
+    }
+
+  for (p = gids; ; p = end)
+    {
+      gid = (gid_t) strtoul (p, &end, 10);
+      if (end == p)
+	  break;
+
+      if ((gid == group) || (gid < getconf ()->mingid))
+	  continue;
+
+      /*
+       * Running out of memory mustn't pass for having all the groups,
+       * or the user would silently lose some.
+       */
+
+      if ((added = addgroup (gid, start, size, groupsp, limit)) < 0)
+	{
+	  free (gids);
+	  *errnop = ENOMEM;
+	  return NSS_STATUS_TRYAGAIN;
+	}
+
+      if (added == 0)
+	  break;
+
+      status = NSS_STATUS_SUCCESS;
+    }
+
+  free (gids);
 
   return status;
 }
 
-
 /*
  * _nss_external_setgrent
  */
@@ -272,12 +519,12 @@ enum nss_status
 _nss_external_setgrent (void)
 {
   CHECKDISABLED;
+  STAT (STAT_SETGRENT);
 
-  if (proc != NULL)
-      cmdclose (proc);
-
-  proc = cmdopen (GROUPCMD, "");
-  gproc = proc;
+  pthread_mutex_lock (&lock);
+  streamclose (stream);
+  stream = streamopen (DB_GROUP);
+  pthread_mutex_unlock (&lock);
 
   return NSS_STATUS_SUCCESS;
 }
@@ -293,25 +540,13 @@ _nss_external_getgrent_r (struct group *result, char *buffer, size_t buflen,
   enum nss_status status;
 
   CHECKDISABLED;
+  STAT (STAT_GETGRENT);
 
-  *errnop = 0;
-
-  CHECKUNAVAIL(gproc);
-
-  for (;;)
-    {
-      CHECKLAST(*gproc);
-      status = buffer_to_grstruct (result, *gproc, buffer, buflen, errnop);
+  pthread_mutex_lock (&lock);
+  status = lookup_next (DB_GROUP, stream, result, buffer, buflen, errnop);
+  pthread_mutex_unlock (&lock);
 
-      if (status == NSS_STATUS_TRYAGAIN)
-          return status;
-
-      /* buffer was large enough, so increment pointer to next result */
-      gproc++;
-
-      if ((status != NSS_STATUS_SUCCESS) || (result->gr_gid >= MINGID))
-	  return status;
-    }
+  return status;
 }
 
 /*
@@ -325,12 +560,48 @@ _nss_external_endgrent (void)
 {
   CHECKDISABLED;
 
-  if (proc != NULL)
-    {
-      cmdclose (proc);
-      proc = NULL;
-      gproc = NULL;
-    }
+  pthread_mutex_lock (&lock);
+  streamclose (stream);
+  stream = NULL;
+  pthread_mutex_unlock (&lock);
 
   return NSS_STATUS_SUCCESS;
 }
+
+/*
+ * Bulk export, through lookup_all().
+ */
+
+struct getgrall
+{
+  int (*fn) (struct group *gr, const char *line, void *arg);
+  void *arg;
+};
+
+static int
+getgrall_line (void *result, const char *line, void *arg)
+{
+  struct getgrall *g = arg;
+
+  return g->fn (result, line, g->arg);
+}
+
+/*
+ * nss_external_getgrall
+ *
+ * Call fn with every group entry at or above the minimum gid, until
+ * it returns non-zero.  Returns UNAVAIL, with errno set, if the command
+ * couldn't be run or its output was cut short.
+ */
+
+enum nss_status
+nss_external_getgrall (int (*fn) (struct group *gr, const char *line,
+				  void *arg), void *arg)
+{
+  struct getgrall g = { fn, arg };
+
+  CHECKDISABLED;
+  STAT (STAT_GETGRALL);
+
+  return lookup_all (DB_GROUP, getgrall_line, &g);
+}
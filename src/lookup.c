@@ -0,0 +1,470 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nss.h>
+#include <pwd.h>
+#include <grp.h>
+#include <shadow.h>
+#include <errno.h>
+
+#include "nss_external.h"
+
+/*
+ * Keyed lookups, enumerations and bulk exports, shared by the passwd,
+ * group and shadow entry points.  What differs between the databases is
+ * how an entry is parsed, and whether it has an id as well as a name;
+ * each database supplies a parser, and for passwd and group, a way to
+ * get the name and id of a parsed entry.
+ */
+
+static enum nss_status
+parsepw (void *result, char *line, char *buffer, size_t buflen, int *errnop)
+{
+  return buffer_to_pwstruct (result, line, buffer, buflen, errnop);
+}
+
+static const char *
+describepw (const void *result, id_t *idp)
+{
+  const struct passwd *pw = result;
+
+  *idp = pw->pw_uid;
+  return pw->pw_name;
+}
+
+static enum nss_status
+parsegr (void *result, char *line, char *buffer, size_t buflen, int *errnop)
+{
+  return buffer_to_grstruct (result, line, buffer, buflen, errnop);
+}
+
+static const char *
+describegr (const void *result, id_t *idp)
+{
+  const struct group *gr = result;
+
+  *idp = gr->gr_gid;
+  return gr->gr_name;
+}
+
+static enum nss_status
+parsesp (void *result, char *line, char *buffer, size_t buflen, int *errnop)
+{
+  return buffer_to_spwdstruct (result, line, buffer, buflen, errnop);
+}
+
+struct lookup lookups[NDB] = {
+  LOOKUP_INITIALIZER (DB_PASSWD, parsepw, describepw),
+  LOOKUP_INITIALIZER (DB_GROUP, parsegr, describegr),
+  LOOKUP_INITIALIZER (DB_SHADOW, parsesp, NULL),
+};
+
+/*
+ * idfloor:
+ *
+ * The minimum id returned from database db.
+ */
+
+id_t
+idfloor (int db)
+{
+  const struct conf *conf = getconf ();
+
+  return (db == DB_GROUP) ? conf->mingid : conf->minuid;
+}
+
+/*
+ * below:
+ *
+ * Is a parsed entry from database db below the minimum id?
+ */
+
+static int
+below (const struct lookup *l, const void *result)
+{
+  id_t id;
+
+  if (l->describe == NULL)
+      return 0;
+
+  l->describe (result, &id);
+  return id < idfloor (l->db);
+}
+
+/*
+ * answer:
+ *
+ * Populate result from a malloc'd copy of an entry, and free it.  An
+ * empty entry means the lookup found nothing, and NULL that we ran out
+ * of memory.
+ */
+
+static enum nss_status
+answer (struct lookup *l, char *line, void *result, char *buffer,
+	size_t buflen, int *errnop)
+{
+  enum nss_status status;
+
+  if (line == NULL)
+    {
+      *errnop = ENOMEM;
+      return NSS_STATUS_TRYAGAIN;
+    }
+
+  if (*line == '\0')
+    {
+      free (line);
+      *errnop = ENOENT;
+      return NSS_STATUS_NOTFOUND;
+    }
+
+  status = l->parse (result, line, buffer, buflen, errnop);
+  free (line);
+
+  return status;
+}
+
+/*
+ * search:
+ *
+ * Run the command for the database, get the result and populate.
+ * Results are served from the snapshot or prefetched database if there's
+ * a fresh one, otherwise from, and remembered in, the lookup cache,
+ * which may answer with stale entries while they're refreshed, or if the
+ * command can't be run.
+ */
+
+static enum nss_status
+search (struct lookup *l, int type, char *arg, void *result, char *buffer,
+	size_t buflen, int *errnop)
+{
+  int db = l->db;
+  char **proc;
+  char *line;
+  const char *name;
+  char key[32];
+  enum nss_status status;
+  id_t id;
+  int found;
+
+  /*
+   * If the caller's buffer was too small for the entry we just fetched,
+   * this is the retry with a bigger one.
+   */
+
+  if ((line = cache_kept (db, type, arg)) != NULL)
+    {
+      status = l->parse (result, line, buffer, buflen, errnop);
+      if ((status == NSS_STATUS_TRYAGAIN) && (*errnop == ERANGE))
+	  cache_keep (db, type, arg, line);
+      free (line);
+      return status;
+    }
+
+  /*
+   * A fresh snapshot, or prefetched copy of the database, holds every
+   * entry, so either answers either way.
+   */
+
+  if ((found = snapshot_get (db, type, arg, &line)) < 0)
+      found = prefetch_get (db, type, arg, &line);
+
+  if (found >= 0)
+      return answer (l, found ? line : strdup (""), result, buffer, buflen,
+		     errnop);
+
+  /*
+   * Anything the daemon has looked up lately is in its shared memory.
+   */
+
+  if (shm_get (db, type, arg, &line))
+      return answer (l, line, result, buffer, buflen, errnop);
+
+  if (cache_get (&l->cache, type, arg, &line)
+      || cache_get (&l->negcache, type, arg, &line))
+      return answer (l, line, result, buffer, buflen, errnop);
+
+  /*
+   * An entry which has expired, but not by too much, is used as is
+   * while a fresh copy is fetched in the background.
+   */
+
+  if ((found = cache_stale (&l->cache, type, arg, 0, &line)) > 0)
+    {
+      if (found > 1)
+	  refresh_start (db, type, arg, &l->cache, &l->negcache, &l->flights);
+      return answer (l, line, result, buffer, buflen, errnop);
+    }
+
+  /*
+   * If another thread is already asking the command for this key,
+   * wait for its answer rather than asking again.
+   */
+
+  if (flight_join (&l->flights, type, arg, &line))
+    {
+      if (line == NULL)
+	  cache_stale (&l->cache, type, arg, 1, &line);
+      CHECKUNAVAIL(line);
+      return answer (l, line, result, buffer, buflen, errnop);
+    }
+
+  if (type == CACHE_ID)
+      proc = cmdbatch (db, arg, &l->cache, &l->negcache);
+  else
+      proc = cmdopen (db, KEYARGS (arg));
+
+  flight_land (&l->flights, type, arg,
+	       (proc == NULL) ? NULL : (proc[0] == NULL) ? "" : proc[0]);
+
+  /*
+   * Rather than fail because the command can't be run, use whatever
+   * we last knew.
+   */
+
+  if ((proc == NULL) && cache_stale (&l->cache, type, arg, 1, &line))
+      return answer (l, line, result, buffer, buflen, errnop);
+
+  CHECKUNAVAIL(proc);
+
+  if (proc[0] == NULL)
+    {
+      cache_put (&l->negcache, type, arg, "");
+      cmdclose (proc);
+      *errnop = ENOENT;
+      return NSS_STATUS_NOTFOUND;
+    }
+
+  /*
+   * Remember the line under the key we were asked for, and if it
+   * parsed, under the other key as well.
+   */
+
+  cache_put (&l->cache, type, arg, proc[0]);
+
+  status = l->parse (result, proc[0], buffer, buflen, errnop);
+
+  if ((status == NSS_STATUS_TRYAGAIN) && (*errnop == ERANGE))
+      cache_keep (db, type, arg, proc[0]);
+
+  if ((status == NSS_STATUS_SUCCESS) && (l->describe != NULL))
+    {
+      name = l->describe (result, &id);
+
+      /*
+       * A name which turns out to be below the minimum id (a probe for
+       * root, say, from a program which asks us before files) is
+       * remembered as an empty entry, so that asking again costs
+       * nothing until it expires.
+       */
+
+      if ((type == CACHE_NAME) && (id < idfloor (db)))
+	{
+	  cache_put (&l->cache, CACHE_NAME, arg, "");
+	  *errnop = ENOENT;
+	  status = NSS_STATUS_NOTFOUND;
+	}
+      else if (type == CACHE_ID)
+	  cache_put (&l->cache, CACHE_NAME, name, proc[0]);
+      else
+	{
+	  snprintf (key, sizeof key, "%u", (unsigned) id);
+	  cache_put (&l->cache, CACHE_ID, key, proc[0]);
+	}
+    }
+
+  cmdclose (proc);
+
+  return status;
+}
+
+/*
+ * lookup_key:
+ *
+ * Look up an entry in database db by name (type CACHE_NAME), or by id
+ * (CACHE_ID, with the id as a decimal string), for the getXXnam and
+ * getXXid entry points.  Entries below the minimum id aren't returned,
+ * and keys validkey() refuses are never found.
+ */
+
+enum nss_status
+lookup_key (int db, int type, char *arg, void *result, char *buffer,
+	    size_t buflen, int *errnop)
+{
+  struct lookup *l = &lookups[db];
+  enum nss_status status;
+
+  *errnop = 0;
+
+  if (!validkey (arg))
+    {
+      *errnop = ENOENT;
+      return NSS_STATUS_NOTFOUND;
+    }
+
+  status = search (l, type, arg, result, buffer, buflen, errnop);
+
+  if ((status == NSS_STATUS_SUCCESS) && below (l, result))
+    {
+      *errnop = ENOENT;
+      return NSS_STATUS_NOTFOUND;
+    }
+
+  return status;
+}
+
+/*
+ * lookup_next:
+ *
+ * Return the next entry of an enumeration of database db, skipping
+ * those below the minimum id, for the getXXent entry points.  An
+ * enumeration cut short by a failed or timed out command ends with
+ * UNAVAIL, rather than looking complete.  Called with the enumeration's
+ * lock held.
+ */
+
+enum nss_status
+lookup_next (int db, struct stream *s, void *result, char *buffer,
+	     size_t buflen, int *errnop)
+{
+  struct lookup *l = &lookups[db];
+  enum nss_status status;
+  char *line;
+
+  *errnop = 0;
+
+  CHECKUNAVAIL(s);
+
+  for (;;)
+    {
+      if (((line = streamline (s)) == NULL) && streamerror (s))
+	{
+	  *errnop = streamerror (s);
+	  return NSS_STATUS_UNAVAIL;
+	}
+      CHECKLAST(line);
+      status = l->parse (result, line, buffer, buflen, errnop);
+
+      if (status == NSS_STATUS_TRYAGAIN)
+	  return status;
+
+      /* buffer was large enough, so move on to the next result */
+      streamnext (s);
+
+      if ((status != NSS_STATUS_SUCCESS) || !below (l, result))
+	  return status;
+    }
+}
+
+/*
+ * Bulk export.  Rather than one getXXent_r() call per entry, each
+ * copied into the caller's buffer, lookup_all() reads the whole listing
+ * in one pass, skips entries below the minimum id without parsing them,
+ * and parses the rest into a buffer of its own, which grows as needed.
+ */
+
+struct getall
+{
+  struct lookup *l;
+  int (*fn) (void *result, const char *line, void *arg);
+  void *arg;
+  union
+  {
+    struct passwd pw;
+    struct group gr;
+  } result;
+  char *buffer;
+  size_t size;
+  int nomem;
+};
+
+static int
+getall_line (char *line, void *arg)
+{
+  struct getall *g = arg;
+  char *bigger;
+  int err;
+
+  for (;;)
+    {
+      switch (g->l->parse (&g->result, line, g->buffer, g->size, &err))
+	{
+	case NSS_STATUS_SUCCESS:
+	  return g->fn (&g->result, line, g->arg);
+	case NSS_STATUS_TRYAGAIN:
+	  if ((bigger = realloc (g->buffer, g->size * 2)) == NULL)
+	    {
+	      g->nomem = 1;
+	      return 1;
+	    }
+	  g->buffer = bigger;
+	  g->size *= 2;
+	  break;
+	default:
+	  return 0;		/* not a valid entry, so skip it */
+	}
+    }
+}
+
+/*
+ * lookup_all:
+ *
+ * Call fn with every entry of database db (passwd or group) at or above
+ * the minimum id, until it returns non-zero.  Returns UNAVAIL, with
+ * errno set, if the command couldn't be run or its output was cut
+ * short.
+ */
+
+enum nss_status
+lookup_all (int db, int (*fn) (void *result, const char *line, void *arg),
+	    void *arg)
+{
+  struct getall g = { &lookups[db], fn, arg };
+  int ran, err;
+
+  g.size = READSIZ;
+  if ((g.buffer = malloc (g.size)) == NULL)
+    {
+      errno = ENOMEM;
+      return NSS_STATUS_TRYAGAIN;
+    }
+
+  ran = streamall (db, idfloor (db), getall_line, &g);
+  err = errno;
+  free (g.buffer);
+
+  if (g.nomem)
+    {
+      errno = ENOMEM;
+      return NSS_STATUS_TRYAGAIN;
+    }
+
+  if (!ran)
+    {
+      errno = err;
+      return NSS_STATUS_UNAVAIL;
+    }
+
+  return NSS_STATUS_SUCCESS;
+}
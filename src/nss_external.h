@@ -20,14 +20,23 @@
  */
 
 /*
- * Config
+ * Config.  Apart from CONFFILE, CMDSIZ and READSIZ, these are the
+ * defaults for anything the configuration file doesn't set.
  */
 
+#define CONFFILE "/etc/nss-external.conf"
+
 #define CONFDIR "/etc/nss-external"
 #define PASSWDCMD CONFDIR "/passwd"
 #define GROUPCMD  CONFDIR "/group"
 #define SHADOWCMD CONFDIR "/shadow"
 
+/*
+ * Socket the caching daemon, nss_externald, listens on.
+ */
+
+#define SOCKETPATH "/var/run/nss-external.sock"
+
 /*
  * Minimum UID and GID we'll return
  */
@@ -36,18 +45,177 @@
 #define MINGID 500
 
 /*
- * Size of the commands passed to popen
- * and chunksize for lines.
+ * Maximum size of the argument passed to commands,
+ * and initial size of the output buffer.
  */
 
 #define CMDSIZ   BUFSIZ
-#define CHUNKSIZ 128
+#define READSIZ  65536
+
+/*
+ * How long (in milliseconds) each command may take to answer, and the
+ * most output (in bytes) we'll accept from a command.  Enumerations
+ * may take as long as they like, as long as no more than the timeout
+ * passes without any output.
+ */
+
+#define PASSWD_TIMEOUT  10000
+#define GROUP_TIMEOUT   10000
+#define SHADOW_TIMEOUT  10000
+#define MAXOUTPUT       (128 * 1024 * 1024)
+
+/*
+ * Extra time (in milliseconds) allowed for an answer from the daemon.
+ */
+
+#define DAEMONSLACK     1000
+
+/*
+ * How many connections the daemon serves at once (more wait in its
+ * listen queue), how long (in milliseconds) a client may take to send
+ * its request, or to make room for each part of the reply, and how long
+ * to wait before accepting again when out of descriptors or memory.
+ */
+
+#define DAEMONTHREADS   32
+#define REQTIMEOUT      5000
+#define ACCEPTRETRY     100
+
+/*
+ * Lookup cache: maximum number of entries, and how long (in
+ * seconds) a successful lookup is remembered, per database.
+ */
+
+#define PASSWD_CACHESIZ 1024
+#define GROUP_CACHESIZ  1024
+#define SHADOW_CACHESIZ 64
+#define PASSWD_TTL      300
+#define GROUP_TTL       300
+#define SHADOW_TTL      30
+
+/*
+ * Negative cache: how long (in seconds) a lookup that found nothing
+ * is remembered.  Uses the same sizes as the lookup cache.
+ */
+
+#define PASSWD_NEGTTL   30
+#define GROUP_NEGTTL    30
+#define SHADOW_NEGTTL   10
+
+/*
+ * How long (in seconds) past its TTL an entry may still be answered
+ * from while it's refreshed in the background.  Beyond that, lookups
+ * wait for the command, unless it can't be run, in which case an entry
+ * still cached is used if it expired no more than MAXFALLBACK seconds
+ * ago.  Shadow entries are never used once expired.
+ */
+
+#define PASSWD_MAXSTALE 3600
+#define GROUP_MAXSTALE  3600
+#define SHADOW_MAXSTALE 0
+#define MAXFALLBACK     86400
+
+/*
+ * Snapshots written by nss_external_snapshot, and how old (in seconds)
+ * one may be before it's ignored.  0 means snapshots are never used.
+ */
+
+#define SNAPDIR         "/var/cache/nss-external"
+#define SNAPSHOT_MAXAGE 600
+
+/*
+ * How long (in milliseconds) a line that didn't fit the caller's buffer
+ * is kept for the retry with a bigger one.  glibc retries at once; a
+ * later lookup of the same key is a new lookup.
+ */
+
+#define KEEPTIME 100
+
+/*
+ * How commands are run: by default, run the command ourselves, as the
+ * calling user.  In daemon mode, ask the daemon if it's running, and
+ * run the command ourselves if not.
+ */
+
+#define MODE_DAEMON    0
+#define MODE_SPAWN     1	/* always run the command ourselves */
+#define MODE_COPROCESS 2	/* keep the command running as a co-process */
+
+#define MODE MODE_SPAWN
 
 /*
  * Environment variables.
  */
 
-#define DISABLE  "NSS_EXTERNAL_DISABLE"
+#define DISABLE   "NSS_EXTERNAL_DISABLE"
+#define COPROCESS "NSS_EXTERNAL_COPROCESS"	/* ignored by setuid programs */
+#define CONFENV   "NSS_EXTERNAL_CONF"	/* ignored by setuid programs */
+#define STATSENV  "NSS_EXTERNAL_STATS"	/* file to dump statistics to */
+#define MINUIDENV "NSS_EXTERNAL_MINUID"	/* passed to commands */
+#define MINGIDENV "NSS_EXTERNAL_MINGID"
+
+/*
+ * Argument passed to commands started as a co-process.
+ */
+
+#define COPROCARG "--coprocess"
+
+/*
+ * How long, in seconds, to run a command directly once it has failed
+ * as a co-process, before trying it as one again.
+ */
+
+#define COPROCRETRY 60
+
+/*
+ * Argument asking the group command for the groups a user belongs to.
+ * MEMBER is the default for group_member: whether the command is known
+ * to understand it, so that an empty answer means no groups, rather
+ * than that every group has to be listed to find out.
+ */
+
+#define MEMBERARG "--member"
+#define MEMBER    0
+
+/*
+ * Argument asking a command for several entries at once, followed by
+ * the keys.  Commands are only asked this way when configured to allow
+ * it, and for no more than MAXBATCH keys.  BATCH is the default number
+ * of keys asked for by getpwuid and getgrgid: the id wanted, and the ids
+ * following it.
+ */
+
+#define BATCHARG "--batch"
+#define MAXBATCH 64
+#define BATCH    1
+
+/*
+ * Arguments for a command: a single key, or none, asking for every
+ * entry.
+ */
+
+#define KEYARGS(key) ((char *[]) { (char *) (key), NULL })
+#define NOARGS       ((char *[]) { NULL })
+
+/*
+ * Whether a lookup by key fetches the whole database instead, and
+ * answers from that until the positive TTL expires.  Off by default.
+ */
+
+#define PREFETCH 0
+
+/*
+ * How many commands may run at once for each database, in each process
+ * (or, through the daemon, for the whole system), and how many lookups
+ * may wait for one to finish before any more fail straight away.  In
+ * co-process mode, up to WORKERS co-processes are kept running for each
+ * database instead, and no more than MAXWORKERS may be configured.
+ */
+
+#define MAXPROCS   16
+#define QUEUE      256
+#define WORKERS    1
+#define MAXWORKERS 32
 
 /*
  * Quick macros
@@ -56,13 +224,372 @@
 #define CHECKDISABLED   { if (getenv (DISABLE)) return NSS_STATUS_NOTFOUND; }
 #define CHECKROOT       { if (geteuid () != 0) { *errnop = EPERM; return NSS_STATUS_UNAVAIL; }}
 #define CHECKUNAVAIL(p) { if (p == NULL) { *errnop = ENOENT; return NSS_STATUS_UNAVAIL; }}
-#define CHECKLAST(p)    { if (p == '\0') { *errnop = ENOENT; return NSS_STATUS_NOTFOUND; }}
-#define BAIL            { free (line); cmdclose (file); file = NULL; break; }
+#define CHECKLAST(p)    { if (p == NULL) { *errnop = ENOENT; return NSS_STATUS_NOTFOUND; }}
+
+/*
+ * Runtime configuration, from CONFFILE.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#define DB_PASSWD 0
+#define DB_GROUP  1
+#define DB_SHADOW 2
+#define NDB       3
+
+/*
+ * Stages of a fork(), for the handlers which make sure the child
+ * doesn't inherit a lock held by another thread.
+ */
+
+#define FORK_PREPARE 0
+#define FORK_PARENT  1
+#define FORK_CHILD   2
+
+struct dbconf
+{
+  char *command;
+  int timeout;
+  size_t cachesize;
+  time_t ttl;
+  time_t negttl;
+  time_t maxstale;
+  int batch;
+  int prefetch;
+  int maxprocs;
+  int queue;
+  int workers;
+  int member;
+};
+
+struct conf
+{
+  int mode;
+  uid_t minuid;
+  gid_t mingid;
+  size_t maxoutput;
+  time_t snapmaxage;
+  const char *socket;
+  const char *shmpath;
+  const char *snapdir;
+  struct dbconf db[NDB];
+};
+
+extern const char *const dbnames[NDB];
+
+/*
+ * Lookup cache.  Entries are keyed either by name or by numeric id,
+ * and hold the raw line returned by the command.  The daemon keys
+ * entries by the argument passed to the command.
+ */
+
+#define CACHE_NAME 'n'
+#define CACHE_ID   'i'
+#define CACHE_ARG  'a'
+#define CACHE_MEMBER 'm'
+
+struct cache_entry
+{
+  struct cache_entry *hnext;	/* hash chain */
+  struct cache_entry *prev;	/* LRU list */
+  struct cache_entry *next;
+  int used;			/* hit since it was last at the tail */
+  int type;
+  char *key;
+  char *value;
+  time_t expires;
+  time_t retry;			/* when a stale entry may be refreshed */
+};
+
+struct cache
+{
+  pthread_rwlock_t lock;		/* shared for hits */
+  int db;			/* database, for the size and TTL */
+  int negative;			/* use the negative TTL */
+  struct cache_entry **table;
+  size_t nbuckets;
+  size_t count;
+  struct cache_entry lru;	/* LRU list sentinel */
+  unsigned long generation;	/* bumped by every change */
+};
+
+#define CACHE_INITIALIZER(db, negative) \
+	{ PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP, (db), (negative), \
+	  NULL, 0, 0, { NULL } }
+
+/*
+ * Statistics: event counters, and per database histograms of how long
+ * commands take to answer, in power of two buckets of microseconds.
+ * Counting costs an atomic increment.  The daemon answers a request
+ * for the database "stats" with its own.
+ */
+
+enum counter
+{
+  STAT_GETPWNAM, STAT_GETPWUID, STAT_SETPWENT, STAT_GETPWENT,
+  STAT_GETGRNAM, STAT_GETGRGID, STAT_SETGRENT, STAT_GETGRENT,
+  STAT_INITGROUPS, STAT_GETSPNAM, STAT_SETSPENT, STAT_GETSPENT,
+  STAT_GETPWALL, STAT_GETGRALL, STAT_ASYNC,
+  STAT_SPAWNS, STAT_BYTES, STAT_TIMEOUTS, STAT_PARSEFAIL, STAT_ERANGE,
+  STAT_CACHEHIT, STAT_CACHEMISS, STAT_NEGHIT, STAT_STALEHIT,
+  STAT_STALEFALLBACK, STAT_REFRESH, STAT_SNAPSHOT, STAT_PREFETCH,
+  STAT_SEGMENT, STAT_SHARED, STAT_DAEMON, STAT_REQUESTS, STAT_QUEUED,
+  STAT_REJECTED,
+  NSTATS
+};
+
+#define NBUCKETS 25		/* up to 2^24us, about 17 seconds */
+#define STATSDB  "stats"
+
+struct stats
+{
+  unsigned long counters[NSTATS];
+  unsigned long latency[NDB][NBUCKETS];
+};
+
+extern struct stats stats;
+
+#define STAT(s)       __atomic_add_fetch (&stats.counters[s], 1, __ATOMIC_RELAXED)
+#define STATADD(s, n) __atomic_add_fetch (&stats.counters[s], (n), __ATOMIC_RELAXED)
+
+/*
+ * Pools: a count of callers running something, limited to some number
+ * at once, with a limited number allowed to wait for their turn.
+ */
+
+struct pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pid_t owner;			/* process the counts belong to */
+  int running;
+  int waiting;
+};
+
+#define POOL_INITIALIZER \
+	{ PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 }
+
+/*
+ * Lookups in flight.  While one thread runs the command for a key,
+ * other threads wanting the same key wait for its answer rather than
+ * running the command again.
+ */
+
+struct flight
+{
+  struct flight *next;
+  int type;
+  char *key;
+  char *line;			/* the answer, once landed */
+  pid_t owner;			/* process the leader belongs to */
+  int landed;
+  int waiters;
+  pthread_cond_t cond;
+};
+
+struct flights
+{
+  pthread_mutex_t lock;
+  struct flight *list;
+};
+
+#define FLIGHTS_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, NULL }
+
+/*
+ * Read only table of entries, indexed by name and by id, held in a
+ * single block of memory so that it can be written to disk and mapped
+ * back in as is.  The header is followed by the name index, the id
+ * index, and the text of the entries.  Index slots hold the offset of
+ * an entry in the text plus one, or 0 if the slot is empty.
+ */
+
+#include <stdint.h>
+
+#define TABLEMAGIC   0x6e737865	/* "nsxe" */
+#define TABLEVERSION 1
+
+struct table_header
+{
+  uint32_t magic;
+  uint32_t version;
+  int64_t created;		/* time() when the table was built */
+  uint32_t count;		/* number of entries */
+  uint32_t nslots;		/* slots in each index, a power of two */
+  uint64_t textsize;
+};
+
+struct table
+{
+  void *base;
+  size_t size;
+  int mapped;
+  const struct table_header *hdr;
+  const uint32_t *names;
+  const uint32_t *ids;
+  const char *text;
+};
+
+/*
+ * Shared memory segments, SHMPATH.<database>, in which the daemon
+ * publishes its passwd and group caches as tables, for the library to
+ * read without asking it.  The header is followed by the table, which
+ * may take up all but the last byte of the segment.
+ */
+
+#define SHMPATH    "/var/run/nss-external"
+#define SHMSIZE    (8 * 1024 * 1024)
+#define SHMMAGIC   0x6e73786d	/* "nsxm" */
+#define SHMVERSION 1
+
+struct shm_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;			/* odd while the table is being rewritten */
+  uint32_t reserved;
+  int64_t expires;		/* cache_now() when its first entry expires */
+  uint64_t size;		/* of the whole segment */
+};
+
+/*
+ * Line at a time reader over a command's output, for enumerations.
+ */
+
+struct stream;
+struct passwd;
+struct group;
+struct spwd;
+
+/*
+ * Per database lookup state: the caches for getXXnam/getXXid (one for
+ * entries found, one for keys the command knew nothing about), the
+ * lookups currently running the command, and how to parse an entry.
+ * describe, if set, returns the name of a parsed entry and its id in
+ * *idp, for databases keyed by both.
+ */
+
+#include <nss.h>
+
+struct lookup
+{
+  int db;
+  struct cache cache;
+  struct cache negcache;
+  struct flights flights;
+  enum nss_status (*parse) (void *result, char *line, char *buffer,
+			    size_t buflen, int *errnop);
+  const char *(*describe) (const void *result, id_t *idp);
+};
+
+#define LOOKUP_INITIALIZER(db, parse, describe) \
+	{ (db), CACHE_INITIALIZER ((db), 0), CACHE_INITIALIZER ((db), 1), \
+	  FLIGHTS_INITIALIZER, (parse), (describe) }
+
+extern struct lookup lookups[NDB];
 
 /*
  * Prototypes
  */
 
-char **cmdopen (const char *command, char *arg);
+const struct conf *getconf (void);
+void conf_fork (int stage);
+char **cmdopen (int db, char *const args[]);
+char **cmdrun (int db, char *const args[]);
+char **cmdbatch (int db, const char *id, struct cache *c, struct cache *neg);
+int cmdexec (int db, char *const args[], int queue, pid_t *pidp);
+int cmdjoin (char *const args[], char *buf, size_t size);
+int validkey (const char *key);
+void cmdwait (int db, int fd, pid_t pid);
+void cmdlisting (int db, int n);
+void cmdfork (int stage);
+int cmdreap (int db, int fd, pid_t pid);
+int cmdcheck (const char *command);
+char **cmdreply (int fd, int timeout);
+long long cmdclock (void);
+int cmdtimeout (int db);
+ssize_t cmdread (int fd, char *buf, size_t len, long long deadline);
+int cmdgrow (char **bufp, size_t *sizep, size_t len);
 void cmdclose (char **f);
-char **split (char *buffer, const char *delim);
+char **splitlines (char *buf, size_t len);
+pid_t cmdspawn (const char *command, char *const argv[], int duplex,
+		int *fdp);
+int splitfields (char *line, char **fields, int nfields);
+int parseid (const char *s, id_t *idp);
+int parselong (const char *s, long *lp);
+char **coproc_query (int db, char *const args[]);
+void coproc_fork (int stage);
+int daemon_connect (int db, char *const args[]);
+int daemon_query (int db, char *const args[], char ***filep);
+struct stream *streamopen (int db);
+struct stream *streamrun (int db);
+char *streamline (struct stream *s);
+int streamerror (struct stream *s);
+void streamnext (struct stream *s);
+void streamclose (struct stream *s);
+int streamall (int db, id_t floor, int (*fn) (char *line, void *arg),
+	       void *arg);
+struct table *table_build (char **lines, int byid);
+struct table *table_map (const char *path);
+int table_write (const struct table *t, const char *path, mode_t mode);
+const char *table_find (const struct table *t, int type, const char *key);
+void table_free (struct table *t);
+int snapshot_get (int db, int type, const char *key, char **linep);
+int snapshot_refresh (int db);
+int prefetch_get (int db, int type, const char *key, char **linep);
+int shm_get (int db, int type, const char *key, char **linep);
+int shm_publish (int db, char **lines, time_t expires);
+int pool_enter (struct pool *p, int limit, int depth, int timeout);
+void pool_leave (struct pool *p);
+void pool_fork (struct pool *p, int stage);
+long long stats_clock (void);
+void stats_latency (int db, long long start);
+char *stats_format (void);
+int daemon_request (const char *name, char *const args[], int timeout);
+int flight_join (struct flights *fs, int type, const char *key, char **linep);
+void flight_land (struct flights *fs, int type, const char *key,
+		  const char *line);
+void flight_fork (struct flights *fs, int stage);
+time_t cache_now (void);
+int cache_get (struct cache *c, int type, const char *key, char **valuep);
+int cache_stale (struct cache *c, int type, const char *key, int any,
+		 char **valuep);
+void cache_put (struct cache *c, int type, const char *key, const char *value);
+void cache_line (struct cache *c, int db, const char *line);
+void cache_drop (struct cache *c, int type, const char *key);
+void cache_keep (int db, int type, const char *key, const char *line);
+char *cache_kept (int db, int type, const char *key);
+char **cache_lines (struct cache *c, time_t *expiresp);
+void cache_fork (struct cache *c, int stage);
+void refresh_start (int db, int type, const char *key, struct cache *c,
+		    struct cache *neg, struct flights *fs);
+id_t idfloor (int db);
+enum nss_status lookup_key (int db, int type, char *arg, void *result,
+			    char *buffer, size_t buflen, int *errnop);
+enum nss_status lookup_next (int db, struct stream *s, void *result,
+			     char *buffer, size_t buflen, int *errnop);
+enum nss_status lookup_all (int db, int (*fn) (void *result,
+					       const char *line, void *arg),
+			    void *arg);
+
+/*
+ * The public API: bulk export, for nss_external_getall and other
+ * programs linked with the library, and asynchronous lookups.  This is
+ * include/nss_external.h, installed for them, rather than this file.
+ */
+
+#include "../include/nss_external.h"
+
+/*
+ * Parsers, shared by the entry points and asynchronous lookups.
+ */
+
+enum nss_status buffer_to_pwstruct (struct passwd *pwstruct, char *newbuf,
+				    char *buffer, size_t buflen,
+				    int *errnop);
+enum nss_status buffer_to_grstruct (struct group *grstruct, char *newbuf,
+				    char *buffer, size_t buflen,
+				    int *errnop);
+enum nss_status buffer_to_spwdstruct (struct spwd *spwdstruct, char *newbuf,
+				      char *buffer, size_t buflen,
+				      int *errnop);
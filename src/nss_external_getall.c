@@ -0,0 +1,104 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pwd.h>
+#include <grp.h>
+#include <errno.h>
+
+#include "nss_external.h"
+
+/*
+ * nss_external_getall writes every passwd or group entry the module
+ * would enumerate, at or above the minimum id, to standard output, as
+ * the command gave them.  Unlike getent, the whole listing is read in
+ * one pass, with the output fully buffered.
+ */
+
+static int
+print (const char *line)
+{
+  return (fputs_unlocked (line, stdout) == EOF)
+	 || (putc_unlocked ('\n', stdout) == EOF);
+}
+
+static int
+printpw (struct passwd *pw, const char *line, void *arg)
+{
+  (void) pw;
+  (void) arg;
+
+  return print (line);
+}
+
+static int
+printgr (struct group *gr, const char *line, void *arg)
+{
+  (void) gr;
+  (void) arg;
+
+  return print (line);
+}
+
+static void
+usage (const char *progname)
+{
+  fprintf (stderr, "Usage: %s passwd|group\n", progname);
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  static char out[READSIZ];
+  enum nss_status status;
+  int err;
+
+  if (argc != 2)
+      usage (argv[0]);
+
+  setvbuf (stdout, out, _IOFBF, sizeof out);
+
+  if (strcmp (argv[1], "passwd") == 0)
+      status = nss_external_getpwall (printpw, NULL);
+  else if (strcmp (argv[1], "group") == 0)
+      status = nss_external_getgrall (printgr, NULL);
+  else
+      usage (argv[0]);
+
+  err = errno;
+
+  if ((fflush (stdout) != 0) || ferror (stdout))
+    {
+      perror ("stdout");
+      return 1;
+    }
+
+  if (status != NSS_STATUS_SUCCESS)
+    {
+      fprintf (stderr, "%s: %s: %s\n", argv[0], argv[1], strerror (err));
+      return 1;
+    }
+
+  return 0;
+}
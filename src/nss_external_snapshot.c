@@ -0,0 +1,95 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "nss_external.h"
+
+/*
+ * nss_external_snapshot refreshes the snapshots the library answers
+ * lookups from, by running each command once for all its entries.  It's
+ * meant to be run from cron, more often than the snapshot maximum age.
+ */
+
+static void
+usage (const char *progname)
+{
+  fprintf (stderr, "Usage: %s [passwd|group|shadow]...\n", progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  int want[NDB] = { 0 };
+  int i, db, all = 1, status = 0;
+  const char *dir;
+
+  if ((argc > 1) && (argv[1][0] == '-'))
+      usage (argv[0]);
+
+  for (i = 1; i < argc; i++)
+    {
+      for (db = 0; (db < NDB) && (strcmp (argv[i], dbnames[db]) != 0); db++);
+
+      if (db == NDB)
+	  usage (argv[0]);
+
+      want[db] = 1;
+      all = 0;
+    }
+
+  /*
+   * Never answer our own NSS lookups through the snapshots we're
+   * replacing.
+   */
+
+  setenv (DISABLE, "1", 1);
+
+  dir = getconf ()->snapdir;
+
+  if ((mkdir (dir, 0755) < 0) && (errno != EEXIST))
+    {
+      perror (dir);
+      return 1;
+    }
+
+  for (db = 0; db < NDB; db++)
+    {
+      if (!all && !want[db])
+	  continue;
+
+      if (!snapshot_refresh (db))
+	{
+	  fprintf (stderr, "%s: %s: %s\n", argv[0], dbnames[db],
+		   strerror (errno));
+	  status = 1;
+	}
+    }
+
+  return status;
+}
@@ -0,0 +1,70 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "nss_external.h"
+
+/*
+ * nss_external_stats prints the statistics of the running caching
+ * daemon, one "name value" line each.  A process's own statistics are
+ * dumped when it exits if NSS_EXTERNAL_STATS is set.
+ */
+
+static void
+usage (const char *progname)
+{
+  fprintf (stderr, "Usage: %s\n", progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  char **file, **line;
+  int fd;
+
+  if (argc > 1)
+      usage (argv[0]);
+
+  if ((fd = daemon_request (STATSDB, NOARGS, DAEMONSLACK)) < 0)
+    {
+      fprintf (stderr, "%s: nss_externald is not running\n", argv[0]);
+      return 1;
+    }
+
+  file = cmdreply (fd, DAEMONSLACK);
+  close (fd);
+
+  if (file == NULL)
+    {
+      fprintf (stderr, "%s: no reply from nss_externald\n", argv[0]);
+      return 1;
+    }
+
+  for (line = file; *line != NULL; line++)
+      puts (*line);
+
+  cmdclose (file);
+  return 0;
+}
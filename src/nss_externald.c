@@ -0,0 +1,556 @@
+/*
+ * nss_externald: caching daemon for the nss_external NSS module.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "nss_external.h"
+
+/*
+ * nss_externald runs the external commands on behalf of every process
+ * on the system, and keeps the results in caches shared between them.
+ * Clients connect to the socket (SOCKETPATH by default), send a single "<database> <arg>"
+ * line, and receive the command's output followed by an empty line.
+ * If the command couldn't be run, or the client isn't allowed to see
+ * the answer, the connection is closed without a reply.  A request
+ * for "stats" is answered with the daemon's statistics.
+ *
+ * The passwd and group caches are also published in shared memory
+ * (see shm.c), from which clients can read them without connecting.
+ */
+
+struct database
+{
+  int db;
+  int rootonly;
+  struct cache cache;
+  struct cache negcache;
+  struct flights flights;
+};
+
+static struct database databases[] = {
+  { DB_PASSWD, 0,
+    CACHE_INITIALIZER (DB_PASSWD, 0), CACHE_INITIALIZER (DB_PASSWD, 1),
+    FLIGHTS_INITIALIZER },
+  { DB_GROUP, 0,
+    CACHE_INITIALIZER (DB_GROUP, 0), CACHE_INITIALIZER (DB_GROUP, 1),
+    FLIGHTS_INITIALIZER },
+  { DB_SHADOW, 1,
+    CACHE_INITIALIZER (DB_SHADOW, 0), CACHE_INITIALIZER (DB_SHADOW, 1),
+    FLIGHTS_INITIALIZER },
+};
+
+/*
+ * join:
+ *
+ * Turn the output of cmdrun() back into a single string of newline
+ * terminated lines, and free it.
+ */
+
+static char *
+join (char **file)
+{
+  char **fp, *text, *p;
+  size_t len = 1;
+
+  for (fp = file; *fp != NULL; fp++)
+      len += strlen (*fp) + 1;
+
+  if ((text = malloc (len)) != NULL)
+    {
+      for (p = text, fp = file; *fp != NULL; fp++)
+	  p = stpcpy (stpcpy (p, *fp), "\n");
+      *p = '\0';
+    }
+
+  cmdclose (file);
+
+  return text;
+}
+
+/*
+ * parse:
+ *
+ * Split the arguments of a request, as cmdjoin() made them, into args,
+ * which has room for MAXBATCH + 2.  Only a single key, or one of the
+ * options the library sends followed by the keys it takes, is accepted,
+ * so that clients can't ask the command for anything else.  Returns 0
+ * if the request is none of those.
+ */
+
+static int
+parse (char *text, char **args)
+{
+  char *word;
+  int n = 0, i = 1;
+
+  while ((word = strsep (&text, " ")) != NULL)
+    {
+      if (n == MAXBATCH + 1)
+	  return 0;
+      args[n++] = word;
+    }
+
+  args[n] = NULL;
+
+  if (strcmp (args[0], BATCHARG) == 0)
+    {
+      if (n < 2)
+	  return 0;
+    }
+  else if (strcmp (args[0], MEMBERARG) == 0)
+    {
+      if (n != 2)
+	  return 0;
+    }
+  else if (n == 1)
+      i = 0;
+  else
+      return 0;
+
+  for (; i < n; i++)
+      if (!validkey (args[i]))
+	  return 0;
+
+  return 1;
+}
+
+/*
+ * lookup:
+ *
+ * Return the output of the database's command for key, the text of the
+ * request, as a malloc'd string, from the cache if we can.  Returns
+ * NULL if the command couldn't be run, or the request isn't one we
+ * accept.
+ */
+
+static char *
+lookup (struct database *db, const char *key)
+{
+  char *args[MAXBATCH + 2];
+  char copy[CMDSIZ];
+  char **file;
+  char *text = NULL;
+
+  snprintf (copy, sizeof copy, "%s", key);
+
+  if (!parse (copy, args))
+      return NULL;
+
+  if (cache_get (&db->cache, CACHE_ARG, key, &text)
+      || cache_get (&db->negcache, CACHE_ARG, key, &text))
+      return text;
+
+  /*
+   * Clients asking for the same key at once share one run of the
+   * command.
+   */
+
+  if (flight_join (&db->flights, CACHE_ARG, key, &text))
+      return text;
+
+  if ((file = cmdrun (db->db, args)) != NULL)
+      text = join (file);
+
+  flight_land (&db->flights, CACHE_ARG, key, text);
+
+  if (text == NULL)
+      return NULL;
+
+  cache_put (*text ? &db->cache : &db->negcache, CACHE_ARG, key, text);
+
+  return text;
+}
+
+/*
+ * enumerate:
+ *
+ * Pass the database's entries straight through to the client as the
+ * command produces them.  Enumerations aren't cached.  The closing
+ * empty line is only sent if the command's output was read to the end,
+ * so that a client can tell a listing cut short from a complete one.
+ */
+
+static void
+enumerate (int fd, struct database *db)
+{
+  struct stream *s;
+  char *line;
+
+  if ((s = streamrun (db->db)) == NULL)
+      return;
+
+  while ((line = streamline (s)) != NULL)
+    {
+      if ((send (fd, line, strlen (line), MSG_NOSIGNAL) < 0)
+	  || (send (fd, "\n", 1, MSG_NOSIGNAL) < 0))
+	{
+	  streamclose (s);
+	  return;
+	}
+      streamnext (s);
+    }
+
+  if (!streamerror (s))
+      send (fd, "\n", 1, MSG_NOSIGNAL);
+
+  streamclose (s);
+}
+
+/*
+ * allowed:
+ *
+ * Shadow entries are only handed to root, as CHECKROOT does in the
+ * library.
+ */
+
+static int
+allowed (int fd, struct database *db)
+{
+  struct ucred cred;
+  socklen_t len = sizeof cred;
+
+  if (!db->rootonly)
+      return 1;
+
+  if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+      return 0;
+
+  return cred.uid == 0;
+}
+
+/*
+ * request:
+ *
+ * Read the request line from a client into req, giving it REQTIMEOUT
+ * milliseconds to send it all.  Returns the number of bytes read, or
+ * -1 if the client hung up or took too long.
+ */
+
+static ssize_t
+request (int fd, char *req, size_t size)
+{
+  struct pollfd pfd;
+  long long deadline = cmdclock () + REQTIMEOUT;
+  size_t len = 0;
+  ssize_t n;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  while ((len < size) && (memchr (req, '\n', len) == NULL))
+    {
+      if (cmdclock () >= deadline)
+	  return -1;
+
+      if ((n = poll (&pfd, 1, (int) (deadline - cmdclock ()))) <= 0)
+	{
+	  if ((n < 0) && (errno != EINTR))
+	      return -1;
+	  continue;
+	}
+
+      if ((n = read (fd, req + len, size - len)) <= 0)
+	{
+	  if ((n < 0) && (errno == EINTR))
+	      continue;
+	  return -1;
+	}
+      len += n;
+    }
+
+  return len;
+}
+
+/*
+ * serve:
+ *
+ * Handle a single client connection.
+ */
+
+static void
+serve (int fd)
+{
+  char req[CMDSIZ];
+  char *key, *text;
+  size_t i;
+  ssize_t len;
+
+  if ((len = request (fd, req, sizeof req)) < 0)
+    {
+      close (fd);
+      return;
+    }
+
+  if ((key = memchr (req, '\n', len)) == NULL)
+    {
+      close (fd);
+      return;
+    }
+  *key = '\0';
+
+  if ((key = strchr (req, ' ')) == NULL)
+    {
+      close (fd);
+      return;
+    }
+  *key++ = '\0';
+
+  STAT (STAT_REQUESTS);
+
+  if (strcmp (req, STATSDB) == 0)
+    {
+      if ((text = stats_format ()) != NULL)
+	{
+	  send (fd, text, strlen (text), MSG_NOSIGNAL);
+	  send (fd, "\n", 1, MSG_NOSIGNAL);
+	  free (text);
+	}
+      close (fd);
+      return;
+    }
+
+  for (i = 0; i < sizeof databases / sizeof databases[0]; i++)
+    {
+      struct database *db = &databases[i];
+
+      if (strcmp (dbnames[db->db], req) != 0)
+	  continue;
+
+      if (!allowed (fd, db))
+	  break;
+
+      if (*key == '\0')
+	  enumerate (fd, db);
+      else if ((text = lookup (db, key)) != NULL)
+	{
+	  send (fd, text, strlen (text), MSG_NOSIGNAL);
+	  send (fd, "\n", 1, MSG_NOSIGNAL);
+	  free (text);
+	}
+      break;
+    }
+
+  close (fd);
+}
+
+/*
+ * worker:
+ *
+ * Serve connections on the listening socket, one at a time.  Replies
+ * that the client doesn't make room for within REQTIMEOUT are cut
+ * short, so that a stuck client can't hold on to a worker.
+ */
+
+static void *
+worker (void *arg)
+{
+  int lfd = (int) (intptr_t) arg;
+  struct timeval tv;
+  int fd;
+
+  tv.tv_sec = REQTIMEOUT / 1000;
+  tv.tv_usec = (REQTIMEOUT % 1000) * 1000;
+
+  for (;;)
+    {
+      /*
+       * A client giving up before we got to it only loses that client,
+       * but running out of descriptors or memory lasts a while, and
+       * going straight back to accept4() would just spin.
+       */
+
+      if ((fd = accept4 (lfd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+	{
+	  if ((errno != EINTR) && (errno != ECONNABORTED))
+	      poll (NULL, 0, ACCEPTRETRY);
+	  continue;
+	}
+
+      setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+      serve (fd);
+    }
+
+  return NULL;
+}
+
+/*
+ * publish:
+ *
+ * Once a second, publish each cache that has changed, or whose first
+ * entry has expired, since it was last published.  The shadow cache is
+ * never published.
+ */
+
+static void *
+publish (void *arg)
+{
+  unsigned long seen[NDB], generation;
+  time_t expires[NDB];
+  struct database *db;
+  char **lines;
+  int i;
+
+  (void) arg;
+
+  for (i = 0; i < NDB; i++)
+    {
+      seen[i] = ~0UL;
+      expires[i] = 0;
+    }
+
+  for (;;)
+    {
+      for (i = 0; i < NDB; i++)
+	{
+	  db = &databases[i];
+
+	  if (db->rootonly)
+	      continue;
+
+	  pthread_rwlock_rdlock (&db->cache.lock);
+	  generation = db->cache.generation;
+	  pthread_rwlock_unlock (&db->cache.lock);
+
+	  if ((generation == seen[i])
+	      && ((expires[i] == 0) || (expires[i] > cache_now ())))
+	      continue;
+
+	  lines = cache_lines (&db->cache, &expires[i]);
+	  shm_publish (db->db, lines, expires[i]);
+	  cmdclose (lines);
+
+	  seen[i] = generation;
+	}
+
+      sleep (1);
+    }
+
+  return NULL;
+}
+
+static void
+usage (const char *progname)
+{
+  fprintf (stderr, "Usage: %s [-f]\n", progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *socket_path;
+  struct sockaddr_un sun;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int foreground = 0;
+  int opt, lfd, i;
+
+  while ((opt = getopt (argc, argv, "f")) != -1)
+    {
+      switch (opt)
+	{
+	case 'f':
+	  foreground = 1;
+	  break;
+	default:
+	  usage (argv[0]);
+	}
+    }
+
+  /*
+   * Never answer our own NSS lookups through ourselves.
+   */
+
+  setenv (DISABLE, "1", 1);
+  signal (SIGPIPE, SIG_IGN);
+
+  /*
+   * The socket's path is read once, here; changing it means restarting
+   * the daemon.
+   */
+
+  socket_path = getconf ()->socket;
+
+  if (strlen (socket_path) >= sizeof sun.sun_path)
+    {
+      fprintf (stderr, "%s: socket path too long\n", socket_path);
+      return 1;
+    }
+
+  memset (&sun, 0, sizeof sun);
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, socket_path);
+
+  if ((lfd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+      perror ("socket");
+      return 1;
+    }
+
+  unlink (socket_path);
+
+  if ((bind (lfd, (struct sockaddr *) &sun, sizeof sun) < 0)
+      || (chmod (socket_path, 0666) < 0)
+      || (listen (lfd, SOMAXCONN) < 0))
+    {
+      perror (socket_path);
+      return 1;
+    }
+
+  if (!foreground && (daemon (0, 0) < 0))
+    {
+      perror ("daemon");
+      return 1;
+    }
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+  if (pthread_create (&thread, &attr, publish, NULL) != 0)
+    {
+      perror ("pthread_create");
+      return 1;
+    }
+
+  for (i = 0; i < DAEMONTHREADS; i++)
+    {
+      if (pthread_create (&thread, &attr, worker, (void *) (intptr_t) lfd) != 0)
+	{
+	  perror ("pthread_create");
+	  return 1;
+	}
+    }
+
+  for (;;)
+      pause ();
+}
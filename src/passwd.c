@@ -26,30 +26,33 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "nss_external.h"
 
 /*
- * Needed for getpwent() statefulness.
+ * Needed for getpwent() statefulness.  The lock keeps threads
+ * enumerating at the same time from treading on each other.
  */
 
-static char **proc = NULL;
-static char **pproc;
+static struct stream *stream = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * buffer_to_pwstruct:
  *
  * Given a buffer containing a single passwd(5) line, populate a
- * password struct.  Note that the ':' in the buffer are converted
- * to '\0' by the call to split.
+ * password struct.  The line is copied into the caller's buffer, and
+ * the ':' in the copy are converted to '\0' by splitfields.
  */
 
-static enum nss_status
+enum nss_status
 buffer_to_pwstruct (struct passwd *pwstruct, char *newbuf, char *buffer,
 		    size_t buflen, int *errnop)
 {
-  char **array;
-  size_t count;
+  char *fields[7];
+  size_t len;
+  id_t uid, gid;
 
   if (pwstruct == NULL)
     {
@@ -58,37 +61,24 @@ buffer_to_pwstruct (struct passwd *pwstruct, char *newbuf, char *buffer,
       return NSS_STATUS_TRYAGAIN;
     }
 
-  if (strlen (newbuf) >= buflen)
+  if ((len = strlen (newbuf)) >= buflen)
     {
+      STAT (STAT_ERANGE);
       *errnop = ERANGE;
       return NSS_STATUS_TRYAGAIN;
     }
 
-  strncpy (buffer, newbuf, buflen);
+  memcpy (buffer, newbuf, len + 1);
 
   /*
-   * split on ':'
+   * sanity check: we should have 7 fields, and numeric ids.  If not,
+   * it's not a valid entry, so return NOTFOUND
    */
 
-  array = split (buffer, ":");
-
-  if (array == NULL)
+  if ((splitfields (buffer, fields, 7) != 7)
+      || !parseid (fields[2], &uid) || !parseid (fields[3], &gid))
     {
-      /* couldn't split on the buffer */
-      *errnop = EAGAIN;
-      return NSS_STATUS_TRYAGAIN;
-    }
-
-  /*
-   * sanity check: we should have 7 fields.  If not, it's
-   * not a valid entry, so return NOTFOUND
-   */
-
-  for (count = 0; array[count] != NULL; count++);
-
-  if (count != 7)
-    {
-      free (array);
+      STAT (STAT_PARSEFAIL);
       *errnop = ENOENT;
       return NSS_STATUS_NOTFOUND;
     }
@@ -97,45 +87,17 @@ buffer_to_pwstruct (struct passwd *pwstruct, char *newbuf, char *buffer,
    * Populate the pwstruct
    */
 
-  pwstruct->pw_name   = array[0];
-  pwstruct->pw_passwd = array[1];
-  pwstruct->pw_uid    = (uid_t) atoi (array[2]);
-  pwstruct->pw_gid    = (gid_t) atoi (array[3]);
-  pwstruct->pw_gecos  = array[4];
-  pwstruct->pw_dir    = array[5];
-  pwstruct->pw_shell  = array[6];
-
-  free (array);
+  pwstruct->pw_name   = fields[0];
+  pwstruct->pw_passwd = fields[1];
+  pwstruct->pw_uid    = (uid_t) uid;
+  pwstruct->pw_gid    = (gid_t) gid;
+  pwstruct->pw_gecos  = fields[4];
+  pwstruct->pw_dir    = fields[5];
+  pwstruct->pw_shell  = fields[6];
 
   return NSS_STATUS_SUCCESS;
 }
 
-/*
- * search:
- *
- * When passed a command, get the result and populate.
- */
-
-static enum nss_status
-search (const char *command, char *arg, struct passwd *result, char *buffer,
-	size_t buflen, int *errnop)
-{
-  char **proc;
-  enum nss_status status;
-
-  *errnop = 0;
-
-  proc = cmdopen (command, arg);
-
-  CHECKUNAVAIL(proc);
-  CHECKLAST(proc[0]);
-
-  status = buffer_to_pwstruct (result, proc[0], buffer, buflen, errnop);
-  cmdclose (proc);
-
-  return status;
-}
-
 /*
  * _nss_external_getpwuid_r
  */
@@ -147,23 +109,25 @@ _nss_external_getpwuid_r (uid_t uid, struct passwd *result, char *buffer,
   char arg[CMDSIZ];
 
   CHECKDISABLED;
+  STAT (STAT_GETPWUID);
 
   *errnop = 0;
 
-  if (uid < MINUID)
+  if (uid < getconf ()->minuid)
       return NSS_STATUS_NOTFOUND;
 
   /*
    * Will the arg overflow?
    */
 
-  if (snprintf (arg, CMDSIZ, "%d", uid) >= CMDSIZ)
+  if (snprintf (arg, CMDSIZ, "%u", (unsigned) uid) >= CMDSIZ)
     {
       *errnop = ENOENT;
       return NSS_STATUS_UNAVAIL;
     }
 
-  return search (PASSWDCMD, arg, result, buffer, buflen, errnop);
+  return lookup_key (DB_PASSWD, CACHE_ID, arg, result, buffer, buflen,
+		     errnop);
 }
 
 /*
@@ -174,19 +138,11 @@ enum nss_status
 _nss_external_getpwnam_r (const char *name, struct passwd *result,
 			  char *buffer, size_t buflen, int *errnop)
 {
-  enum nss_status status;
-
   CHECKDISABLED;
+  STAT (STAT_GETPWNAM);
 
-  *errnop = 0;
-
-  status = search (PASSWDCMD, (char *) name, result, buffer, buflen, errnop);
-
-  if (status == NSS_STATUS_SUCCESS)
-      if (result->pw_uid < MINUID)
-	  return NSS_STATUS_NOTFOUND;
-
-  return status;
+  return lookup_key (DB_PASSWD, CACHE_NAME, (char *) name, result, buffer,
+		     buflen, errnop);
 }
 
 /*
@@ -199,12 +155,12 @@ enum nss_status
 _nss_external_setpwent (void)
 {
   CHECKDISABLED;
+  STAT (STAT_SETPWENT);
 
-  if (proc != NULL)
-      cmdclose (proc);
-
-  proc = cmdopen (PASSWDCMD, "");
-  pproc = proc;
+  pthread_mutex_lock (&lock);
+  streamclose (stream);
+  stream = streamopen (DB_PASSWD);
+  pthread_mutex_unlock (&lock);
 
   return NSS_STATUS_SUCCESS;
 }
@@ -219,28 +175,16 @@ enum nss_status
 _nss_external_getpwent_r (struct passwd *result, char *buffer, size_t buflen,
 			  int *errnop)
 {
-  CHECKDISABLED;
-
-  *errnop = 0;
-
-  CHECKUNAVAIL(pproc);
-
-  for (;;)
-    {
-      enum nss_status status;
-
-      CHECKLAST(*pproc);
-      status = buffer_to_pwstruct (result, *pproc, buffer, buflen, errnop);
+  enum nss_status status;
 
-      if (status == NSS_STATUS_TRYAGAIN)
-	  return status;
+  CHECKDISABLED;
+  STAT (STAT_GETPWENT);
 
-      /* buffer was large enough, so increment pointer to next result */
-      pproc++;
+  pthread_mutex_lock (&lock);
+  status = lookup_next (DB_PASSWD, stream, result, buffer, buflen, errnop);
+  pthread_mutex_unlock (&lock);
 
-      if ((status != NSS_STATUS_SUCCESS) || (result->pw_uid >= MINUID))
-	  return status;
-    }
+  return status;
 }
 
 /*
@@ -254,12 +198,48 @@ _nss_external_endpwent (void)
 {
   CHECKDISABLED;
 
-  if (proc != NULL)
-    {
-      cmdclose (proc);
-      proc = NULL;
-      pproc = NULL;
-    }
+  pthread_mutex_lock (&lock);
+  streamclose (stream);
+  stream = NULL;
+  pthread_mutex_unlock (&lock);
 
   return NSS_STATUS_SUCCESS;
 }
+
+/*
+ * Bulk export, through lookup_all().
+ */
+
+struct getpwall
+{
+  int (*fn) (struct passwd *pw, const char *line, void *arg);
+  void *arg;
+};
+
+static int
+getpwall_line (void *result, const char *line, void *arg)
+{
+  struct getpwall *g = arg;
+
+  return g->fn (result, line, g->arg);
+}
+
+/*
+ * nss_external_getpwall
+ *
+ * Call fn with every passwd entry at or above the minimum uid, until
+ * it returns non-zero.  Returns UNAVAIL, with errno set, if the command
+ * couldn't be run or its output was cut short.
+ */
+
+enum nss_status
+nss_external_getpwall (int (*fn) (struct passwd *pw, const char *line,
+				  void *arg), void *arg)
+{
+  struct getpwall g = { fn, arg };
+
+  CHECKDISABLED;
+  STAT (STAT_GETPWALL);
+
+  return lookup_all (DB_PASSWD, getpwall_line, &g);
+}
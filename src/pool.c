@@ -0,0 +1,140 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "nss_external.h"
+
+/*
+ * A pool bounds how many commands (or co-processes) are busy at once,
+ * so that a burst of lookups can't start a command each.  Callers over
+ * the limit wait in line for a turn, up to the configured depth of the
+ * queue; beyond that, or if their turn doesn't come within the
+ * command's timeout, they're turned away, and the lookup fails as if
+ * the command couldn't be run.
+ */
+
+/*
+ * pool_enter:
+ *
+ * Wait until fewer than limit callers (or any number, if limit is 0)
+ * are running, for no more than timeout milliseconds, and with no more
+ * than depth others waiting already.  Returns 1, counted as running,
+ * or 0 if turned away.
+ */
+
+int
+pool_enter (struct pool *p, int limit, int depth, int timeout)
+{
+  struct timespec ts;
+  int ok = 1;
+
+  pthread_mutex_lock (&p->lock);
+
+  /*
+   * After a fork, the callers counted belong to our parent.
+   */
+
+  if (p->owner != getpid ())
+    {
+      p->owner = getpid ();
+      p->running = p->waiting = 0;
+    }
+
+  if ((limit > 0) && (p->running >= limit))
+    {
+      if (p->waiting >= depth)
+	  ok = 0;
+      else
+	{
+	  STAT (STAT_QUEUED);
+
+	  clock_gettime (CLOCK_REALTIME, &ts);
+	  ts.tv_sec += timeout / 1000;
+	  ts.tv_nsec += (timeout % 1000) * 1000000L;
+	  if (ts.tv_nsec >= 1000000000L)
+	    {
+	      ts.tv_sec++;
+	      ts.tv_nsec -= 1000000000L;
+	    }
+
+	  p->waiting++;
+	  while (ok && (p->running >= limit))
+	      if ((pthread_cond_timedwait (&p->cond, &p->lock, &ts) == ETIMEDOUT)
+		  && (p->running >= limit))
+		  ok = 0;
+	  p->waiting--;
+	}
+    }
+
+  if (ok)
+      p->running++;
+  else
+      STAT (STAT_REJECTED);
+
+  pthread_mutex_unlock (&p->lock);
+
+  return ok;
+}
+
+/*
+ * pool_leave:
+ *
+ * Finish running, and let the next caller in line have its turn.
+ */
+
+void
+pool_leave (struct pool *p)
+{
+  pthread_mutex_lock (&p->lock);
+
+  if ((p->owner == getpid ()) && (p->running > 0))
+      p->running--;
+
+  pthread_cond_signal (&p->cond);
+  pthread_mutex_unlock (&p->lock);
+}
+
+/*
+ * pool_fork:
+ *
+ * Hold the pool's lock across a fork(), so that the child doesn't
+ * inherit it held by a thread it doesn't have.  Nobody waits in the
+ * child, so the condition is started afresh there.
+ */
+
+void
+pool_fork (struct pool *p, int stage)
+{
+  if (stage == FORK_PREPARE)
+      pthread_mutex_lock (&p->lock);
+  else
+    {
+      if (stage == FORK_CHILD)
+	  pthread_cond_init (&p->cond, NULL);
+      pthread_mutex_unlock (&p->lock);
+    }
+}
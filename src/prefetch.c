@@ -0,0 +1,138 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "nss_external.h"
+
+/*
+ * Prefetch mode.
+ *
+ * For commands which take about as long to list everything as to look
+ * up one entry, the first lookup by key lists the whole database once,
+ * and builds a table of it indexed by name and id.  Lookups are
+ * answered from the table until the positive TTL expires, when the next
+ * lookup lists the database again.  If listing fails, lookups go to the
+ * command one key at a time until the negative TTL has passed.
+ *
+ * Only one thread lists the database; others wanting it wait on the
+ * load lock, then use its table.
+ */
+
+struct prefetch
+{
+  pthread_mutex_t load;
+  pthread_rwlock_t lock;
+  struct table *table;
+  time_t expires;		/* when to list the database again */
+};
+
+static struct prefetch prefetches[NDB] = {
+  { PTHREAD_MUTEX_INITIALIZER, PTHREAD_RWLOCK_INITIALIZER, NULL, 0 },
+  { PTHREAD_MUTEX_INITIALIZER, PTHREAD_RWLOCK_INITIALIZER, NULL, 0 },
+  { PTHREAD_MUTEX_INITIALIZER, PTHREAD_RWLOCK_INITIALIZER, NULL, 0 },
+};
+
+/*
+ * refresh:
+ *
+ * List the database, and replace the table.  Called with the load lock
+ * held.
+ */
+
+static void
+refresh (struct prefetch *pp, int db)
+{
+  const struct dbconf *d = &getconf ()->db[db];
+  struct table *t = NULL, *old;
+  char **lines;
+
+  if ((lines = cmdopen (db, NOARGS)) != NULL)
+    {
+      if (lines[0] != NULL)
+	  t = table_build (lines, db != DB_SHADOW);
+      cmdclose (lines);
+    }
+
+  pthread_rwlock_wrlock (&pp->lock);
+  old = pp->table;
+  pp->table = t;
+  __atomic_store_n (&pp->expires,
+		    cache_now () + ((t != NULL) ? d->ttl : d->negttl),
+		    __ATOMIC_RELAXED);
+  pthread_rwlock_unlock (&pp->lock);
+
+  table_free (old);
+}
+
+/*
+ * prefetch_get:
+ *
+ * Look key up in the prefetched copy of database db, listing the
+ * database first if it's due.  Returns 1 with *linep set to a malloc'd
+ * copy of the entry if it's there, 0 if it isn't, or -1 if prefetching
+ * isn't on, or isn't working.
+ */
+
+int
+prefetch_get (int db, int type, const char *key, char **linep)
+{
+  struct prefetch *pp = &prefetches[db];
+  const char *line;
+  int found = -1;
+
+  *linep = NULL;
+
+  if (!getconf ()->db[db].prefetch)
+      return -1;
+
+  if ((db == DB_SHADOW) && (type != CACHE_NAME))
+      return -1;
+
+  if (__atomic_load_n (&pp->expires, __ATOMIC_RELAXED) <= cache_now ())
+    {
+      pthread_mutex_lock (&pp->load);
+      if (pp->expires <= cache_now ())
+	  refresh (pp, db);
+      pthread_mutex_unlock (&pp->load);
+    }
+
+  pthread_rwlock_rdlock (&pp->lock);
+
+  if (pp->table != NULL)
+    {
+      if ((line = table_find (pp->table, type, key)) == NULL)
+	  found = 0;
+      else if ((*linep = strdup (line)) != NULL)
+	  found = 1;
+    }
+
+  pthread_rwlock_unlock (&pp->lock);
+
+  if (found >= 0)
+      STAT (STAT_PREFETCH);
+
+  return found;
+}
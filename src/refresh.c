@@ -0,0 +1,205 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "nss_external.h"
+
+/*
+ * Stale while revalidate.
+ *
+ * When a lookup is answered from an expired cache entry, a thread is
+ * started to ask the command for a fresh copy, so that the caller
+ * doesn't wait for it.  If the command no longer knows the key, the
+ * stale entry is dropped, and the key goes into the negative cache.  If
+ * the command can't be run, the stale entry stays.
+ *
+ * Those threads are ours, not the program's, and the program may fork
+ * while one of them holds a lock, say a shell or a daemon which looked a
+ * user up earlier.  So once we've started one, every lock a refresh
+ * takes is held across fork(), and released again on both sides.  The
+ * state behind them already knows to forget what belonged to the
+ * parent.
+ */
+
+struct refresh
+{
+  int db;
+  int type;
+  char *key;
+  struct cache *cache;
+  struct cache *negcache;
+  struct flights *flights;
+};
+
+static void *
+revalidate (void *arg)
+{
+  struct refresh *r = arg;
+  char **proc;
+  char *line;
+
+  /*
+   * If a lookup of the key is already running the command, it will
+   * cache the answer.
+   */
+
+  if (flight_join (r->flights, r->type, r->key, &line))
+      free (line);
+  else
+    {
+      proc = cmdopen (r->db, KEYARGS (r->key));
+
+      flight_land (r->flights, r->type, r->key,
+		   (proc == NULL) ? NULL : (proc[0] == NULL) ? "" : proc[0]);
+
+      if (proc != NULL)
+	{
+	  if (proc[0] == NULL)
+	    {
+	      cache_drop (r->cache, r->type, r->key);
+	      cache_put (r->negcache, r->type, r->key, "");
+	    }
+	  else
+	    {
+	      cache_put (r->cache, r->type, r->key, proc[0]);
+	      cache_line (r->cache, r->db, proc[0]);
+	    }
+	  cmdclose (proc);
+	}
+    }
+
+  free (r->key);
+  free (r);
+
+  return NULL;
+}
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/*
+ * forking:
+ *
+ * Take or release the locks for a fork().  None of them is held while
+ * taking another, so the order only has to be the same each time.
+ */
+
+static void
+forking (int stage)
+{
+  int db;
+
+  conf_fork (stage);
+  coproc_fork (stage);
+
+  for (db = 0; db < NDB; db++)
+    {
+      flight_fork (&lookups[db].flights, stage);
+      cache_fork (&lookups[db].cache, stage);
+      cache_fork (&lookups[db].negcache, stage);
+    }
+
+  cmdfork (stage);
+}
+
+static void
+prepare (void)
+{
+  forking (FORK_PREPARE);
+}
+
+static void
+parent (void)
+{
+  forking (FORK_PARENT);
+}
+
+static void
+child (void)
+{
+  forking (FORK_CHILD);
+}
+
+static void
+atfork_init (void)
+{
+  pthread_atfork (prepare, parent, child);
+}
+
+/*
+ * refresh_start:
+ *
+ * Refresh the entry stored under key in the background.  If that isn't
+ * possible, the entry simply stays stale until a later lookup.
+ */
+
+void
+refresh_start (int db, int type, const char *key, struct cache *c,
+	       struct cache *neg, struct flights *fs)
+{
+  struct refresh *r;
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+
+  if ((r = calloc (1, sizeof (struct refresh))) == NULL)
+      return;
+
+  if ((r->key = strdup (key)) == NULL)
+    {
+      free (r);
+      return;
+    }
+
+  pthread_once (&atfork_once, atfork_init);
+
+  r->db = db;
+  r->type = type;
+  r->cache = c;
+  r->negcache = neg;
+  r->flights = fs;
+
+  /*
+   * The thread belongs to whatever program we've been loaded into, so
+   * make sure none of its signals are delivered to it.
+   */
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+  if (pthread_create (&thread, &attr, revalidate, r) != 0)
+    {
+      free (r->key);
+      free (r);
+    }
+  else
+      STAT (STAT_REFRESH);
+
+  pthread_attr_destroy (&attr);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+}
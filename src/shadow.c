@@ -26,30 +26,34 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "nss_external.h"
 
 /*
- * Needed for getpwent() statefulness.
+ * Needed for getpwent() statefulness.  The lock keeps threads
+ * enumerating at the same time from treading on each other.
  */
 
-static char **proc = NULL;
-static char **sproc;
+static struct stream *stream = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * buffer_to_spwdstruct:
  *
  * Given a buffer containing a single shadow(5) line, populate a
- * shadow passwd struct.  Note that the ':' in the buffer are converted
- * to '\0' by the call to split.
+ * shadow passwd struct.  The line is copied into the caller's buffer,
+ * and the ':' in the copy are converted to '\0' by splitfields.
  */
 
-static enum nss_status
+enum nss_status
 buffer_to_spwdstruct (struct spwd *spwdstruct, char *newbuf, char *buffer,
 		      size_t buflen, int *errnop)
 {
-  char **array;
-  size_t count;
+  char *fields[9];
+  long values[9];
+  size_t len;
+  int i;
 
   if (spwdstruct == NULL)
     {
@@ -58,86 +62,53 @@ buffer_to_spwdstruct (struct spwd *spwdstruct, char *newbuf, char *buffer,
       return NSS_STATUS_TRYAGAIN;
     }
 
-  if (strlen (newbuf) >= buflen)
+  if ((len = strlen (newbuf)) >= buflen)
     {
+      STAT (STAT_ERANGE);
       *errnop = ERANGE;
       return NSS_STATUS_TRYAGAIN;
     }
 
-  strncpy (buffer, newbuf, buflen);
-
-  /*
-   * split on ':'
-   */
-
-  array = split (buffer, ":");
-
-  if (array == NULL)
-    {
-      /* couldn't split on the buffer */
-      *errnop = EAGAIN;
-      return NSS_STATUS_TRYAGAIN;
-    }
+  memcpy (buffer, newbuf, len + 1);
 
   /*
-   * sanity check: we should have 9 fields.  If not, it's not a valid
-   * spwd entry, so return NOTFOUND.
+   * sanity check: we should have 9 fields, all but the first two
+   * numeric or empty.  If not, it's not a valid spwd entry, so return
+   * NOTFOUND.
    */
 
-  for (count = 0; array[count] != NULL; count++);
-
-  if (count != 9)
+  if (splitfields (buffer, fields, 9) != 9)
     {
-      free (array);
+      STAT (STAT_PARSEFAIL);
       *errnop = ENOENT;
       return NSS_STATUS_NOTFOUND;
     }
 
+  for (i = 2; i < 9; i++)
+      if (!parselong (fields[i], &values[i]))
+	{
+	  STAT (STAT_PARSEFAIL);
+	  *errnop = ENOENT;
+	  return NSS_STATUS_NOTFOUND;
+	}
+
   /*
    * Populate the spwdstruct
    */
 
-  spwdstruct->sp_namp   = array[0];
-  spwdstruct->sp_pwdp   = array[1];
-  spwdstruct->sp_lstchg = *array[2] == '\0' ? -1 : atol (array[2]);
-  spwdstruct->sp_min    = *array[3] == '\0' ? -1 : atol (array[3]);
-  spwdstruct->sp_max    = *array[4] == '\0' ? -1 : atol (array[4]);
-  spwdstruct->sp_warn   = *array[5] == '\0' ? -1 : atol (array[5]);
-  spwdstruct->sp_inact  = *array[6] == '\0' ? -1 : atol (array[6]);
-  spwdstruct->sp_expire = *array[7] == '\0' ? -1 : atol (array[7]);
-  spwdstruct->sp_flag   = *array[8] == '\0' ? -1 : strtoul (array[8], NULL, 10);
-
-  free (array);
+  spwdstruct->sp_namp   = fields[0];
+  spwdstruct->sp_pwdp   = fields[1];
+  spwdstruct->sp_lstchg = values[2];
+  spwdstruct->sp_min    = values[3];
+  spwdstruct->sp_max    = values[4];
+  spwdstruct->sp_warn   = values[5];
+  spwdstruct->sp_inact  = values[6];
+  spwdstruct->sp_expire = values[7];
+  spwdstruct->sp_flag   = (unsigned long) values[8];
 
   return NSS_STATUS_SUCCESS;
 }
 
-/*
- * search:
- *
- * When passed a command, get the result and populate.
- */
-
-static enum nss_status
-search (const char *command, char *arg, struct spwd *result, char *buffer,
-	size_t buflen, int *errnop)
-{
-  char **proc;
-  enum nss_status status;
-
-  *errnop = 0;
-
-  proc = cmdopen (command, arg);
-
-  CHECKUNAVAIL(proc);
-  CHECKLAST(proc[0]);
-
-  status = buffer_to_spwdstruct (result, proc[0], buffer, buflen, errnop);
-  cmdclose (proc);
-
-  return status;
-}
-
 /*
  * _nss_external_getspnam_r
  */
@@ -147,11 +118,11 @@ _nss_external_getspnam_r (const char *name, struct spwd *result, char *buffer,
 			  size_t buflen, int *errnop)
 {
   CHECKDISABLED;
+  STAT (STAT_GETSPNAM);
   CHECKROOT;
 
-  *errnop = 0;
-
-  return search (SHADOWCMD, (char *) name, result, buffer, buflen, errnop);
+  return lookup_key (DB_SHADOW, CACHE_NAME, (char *) name, result, buffer,
+		     buflen, errnop);
 }
 
 /*
@@ -162,12 +133,12 @@ enum nss_status
 _nss_external_setspent (void)
 {
   CHECKDISABLED;
+  STAT (STAT_SETSPENT);
 
-  if (proc != NULL)
-      cmdclose (proc);
-
-  proc = cmdopen (SHADOWCMD, "");
-  sproc = proc;
+  pthread_mutex_lock (&lock);
+  streamclose (stream);
+  stream = streamopen (DB_SHADOW);
+  pthread_mutex_unlock (&lock);
 
   return NSS_STATUS_SUCCESS;
 }
@@ -183,19 +154,12 @@ _nss_external_getspent_r (struct spwd *result, char *buffer, size_t buflen,
   enum nss_status status;
 
   CHECKDISABLED;
+  STAT (STAT_GETSPENT);
   CHECKROOT;
 
-  *errnop = 0;
-
-  CHECKUNAVAIL(sproc);
-  CHECKLAST(*sproc);
-
-  status = buffer_to_spwdstruct (result, *sproc, buffer, buflen, errnop);
-
-  if (status == NSS_STATUS_TRYAGAIN)
-      return status;
-
-  sproc++;
+  pthread_mutex_lock (&lock);
+  status = lookup_next (DB_SHADOW, stream, result, buffer, buflen, errnop);
+  pthread_mutex_unlock (&lock);
 
   return status;
 }
@@ -209,12 +173,10 @@ _nss_external_endspent (void)
 {
   CHECKDISABLED;
 
-  if (proc != NULL)
-    {
-      cmdclose (proc);
-      proc = NULL;
-      sproc = NULL;
-    }
+  pthread_mutex_lock (&lock);
+  streamclose (stream);
+  stream = NULL;
+  pthread_mutex_unlock (&lock);
 
   return NSS_STATUS_SUCCESS;
 }
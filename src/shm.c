@@ -0,0 +1,367 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "nss_external.h"
+
+/*
+ * Shared memory segments.
+ *
+ * Once a second, if anything has changed, the daemon copies the live
+ * entries of its passwd and group caches into a table in <shm_path>.<db>,
+ * which every process maps read only, so that a lookup the daemon has
+ * already answered is answered again without a system call, let alone
+ * a round trip to the daemon.
+ *
+ * The table is rewritten in place, under a sequence count: the daemon
+ * makes the count odd, rewrites the table, and makes it even again.  A
+ * reader copies out the entry it wants, with no lock, and then checks
+ * the count is still the even number it started with; if not, or the
+ * daemon isn't keeping the segment up to date, it goes to the daemon
+ * as usual.  As the segment only holds what's been looked up, a key
+ * that isn't there is simply asked for.
+ *
+ * Whatever the daemon was in the middle of writing, a reader stays
+ * within the segment: the table's sizes are checked against it, probes
+ * are bounded, and the last byte of the segment, which is never
+ * written, ends any entry.
+ */
+
+#define SHMROOM (SHMSIZE - sizeof (struct shm_header) - 1)
+
+/*
+ * path:
+ *
+ * Where the segment for database db lives.
+ */
+
+static void
+path (int db, char *buf, size_t len)
+{
+  snprintf (buf, len, "%s.%s", getconf ()->shmpath, dbnames[db]);
+}
+
+/*
+ * The daemon's side.
+ */
+
+static struct shm_header *published[NDB];
+
+/*
+ * create:
+ *
+ * Map the segment for database db read/write.  One left behind by an
+ * earlier daemon is carried on with, so that processes which have it
+ * mapped keep using it; otherwise a new one is made and renamed into
+ * place.
+ */
+
+static struct shm_header *
+create (int db)
+{
+  char file[PATH_MAX], tmp[PATH_MAX];
+  struct shm_header *hdr;
+  struct stat sb;
+  void *base;
+  int fd;
+
+  path (db, file, sizeof file);
+
+  if (((fd = open (file, O_RDWR | O_NOFOLLOW | O_CLOEXEC)) >= 0)
+      && ((fstat (fd, &sb) < 0) || !S_ISREG (sb.st_mode)
+	  || (sb.st_uid != geteuid ()) || (sb.st_size != SHMSIZE)))
+    {
+      close (fd);
+      fd = -1;
+    }
+
+  if (fd < 0)
+    {
+      if ((snprintf (tmp, sizeof tmp, "%s.XXXXXX", file) >= (int) sizeof tmp)
+	  || ((fd = mkostemp (tmp, O_CLOEXEC)) < 0))
+	  return NULL;
+
+      if ((ftruncate (fd, SHMSIZE) < 0) || (rename (tmp, file) < 0))
+	{
+	  close (fd);
+	  unlink (tmp);
+	  return NULL;
+	}
+    }
+
+  if (fchmod (fd, 0644) < 0)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  base = mmap (NULL, SHMSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (base == MAP_FAILED)
+      return NULL;
+
+  /*
+   * A new segment is only marked as one once it's set up, and starts
+   * with no table.
+   */
+
+  hdr = base;
+
+  if ((hdr->magic != SHMMAGIC) || (hdr->version != SHMVERSION)
+      || (hdr->size != SHMSIZE))
+    {
+      hdr->seq = 0;
+      hdr->expires = 0;
+      hdr->size = SHMSIZE;
+      hdr->version = SHMVERSION;
+      __atomic_store_n (&hdr->magic, SHMMAGIC, __ATOMIC_RELEASE);
+    }
+
+  return hdr;
+}
+
+/*
+ * shm_publish:
+ *
+ * Replace the table in the segment for database db with one built from
+ * lines, good until expires.  If lines is NULL, or the table won't fit,
+ * the segment is left empty.  Returns 0 if the table wasn't published.
+ * Only one thread may publish each database.
+ */
+
+int
+shm_publish (int db, char **lines, time_t expires)
+{
+  struct shm_header *hdr;
+  struct table *t = NULL;
+  char *image;
+  uint32_t seq;
+  int ok;
+
+  if ((published[db] == NULL) && ((published[db] = create (db)) == NULL))
+      return 0;
+
+  hdr = published[db];
+  image = (char *) (hdr + 1);
+
+  if (lines != NULL)
+      t = table_build (lines, 1);
+
+  ok = (t != NULL) && (t->size <= SHMROOM);
+
+  /*
+   * The count may have been left odd by a daemon that died writing.
+   */
+
+  seq = hdr->seq | 1;
+  __atomic_store_n (&hdr->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  if (ok)
+    {
+      memcpy (image, t->base, t->size);
+      hdr->expires = expires;
+    }
+  else
+    {
+      memset (image, 0, sizeof (struct table_header));
+      hdr->expires = 0;
+    }
+
+  __atomic_store_n (&hdr->seq, seq + 1, __ATOMIC_RELEASE);
+
+  table_free (t);
+
+  return ok;
+}
+
+/*
+ * The library's side.  Each segment is mapped on first use, and checked
+ * for replacement at most once a second.  A replaced segment is left
+ * mapped, as other threads may still be reading it.
+ */
+
+struct segment
+{
+  pthread_mutex_t lock;
+  const struct shm_header *hdr;
+  time_t checked;
+  dev_t dev;
+  ino_t ino;
+};
+
+static struct segment segments[NDB] = {
+  { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 },
+  { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 },
+  { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 },
+};
+
+/*
+ * attach:
+ *
+ * Map the segment for database db if it's new.  Only a segment written
+ * by root, and nobody else, is trusted.  Called with the lock held.
+ */
+
+static void
+attach (struct segment *sp, int db)
+{
+  const struct shm_header *hdr;
+  char file[PATH_MAX];
+  struct stat sb;
+  void *base;
+  int fd;
+
+  path (db, file, sizeof file);
+
+  if ((stat (file, &sb) < 0)
+      || ((sp->hdr != NULL) && (sb.st_dev == sp->dev)
+	  && (sb.st_ino == sp->ino)))
+      return;
+
+  if ((fd = open (file, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+      return;
+
+  if ((fstat (fd, &sb) < 0) || !S_ISREG (sb.st_mode) || (sb.st_uid != 0)
+      || ((sb.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+      || (sb.st_size != SHMSIZE))
+    {
+      close (fd);
+      return;
+    }
+
+  base = mmap (NULL, SHMSIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (base == MAP_FAILED)
+      return;
+
+  hdr = base;
+
+  if ((__atomic_load_n (&hdr->magic, __ATOMIC_ACQUIRE) != SHMMAGIC)
+      || (hdr->version != SHMVERSION) || (hdr->size != SHMSIZE))
+    {
+      munmap (base, SHMSIZE);
+      return;
+    }
+
+  sp->dev = sb.st_dev;
+  sp->ino = sb.st_ino;
+  __atomic_store_n (&sp->hdr, hdr, __ATOMIC_RELEASE);
+}
+
+/*
+ * shm_get:
+ *
+ * Look key up in the segment for database db, when we're configured to
+ * use the daemon.  Returns 1 with *linep set to a malloc'd copy of the
+ * entry if it's there, or 0 if the caller should ask the daemon.
+ */
+
+int
+shm_get (int db, int type, const char *key, char **linep)
+{
+  struct segment *sp = &segments[db];
+  time_t now = cache_now ();
+  const struct shm_header *hdr;
+  struct table_header th;
+  struct table t;
+  const char *image, *line;
+  uint32_t seq;
+  uint64_t nslots;
+  time_t expires;
+
+  *linep = NULL;
+
+  if ((getconf ()->mode != MODE_DAEMON) || (db == DB_SHADOW))
+      return 0;
+
+  if (__atomic_load_n (&sp->checked, __ATOMIC_RELAXED) != now)
+    {
+      pthread_mutex_lock (&sp->lock);
+      if (sp->checked != now)
+	{
+	  attach (sp, db);
+	  __atomic_store_n (&sp->checked, now, __ATOMIC_RELAXED);
+	}
+      pthread_mutex_unlock (&sp->lock);
+    }
+
+  if ((hdr = __atomic_load_n (&sp->hdr, __ATOMIC_ACQUIRE)) == NULL)
+      return 0;
+
+  image = (const char *) (hdr + 1);
+
+  if ((seq = __atomic_load_n (&hdr->seq, __ATOMIC_ACQUIRE)) & 1)
+      return 0;
+
+  /*
+   * Work from a copy of the table's header, so that the sizes checked
+   * are the sizes used.
+   */
+
+  expires = hdr->expires;
+  memcpy (&th, image, sizeof th);
+  nslots = th.nslots;
+
+  if ((th.magic == TABLEMAGIC) && (th.version == TABLEVERSION)
+      && (nslots != 0) && ((nslots & (nslots - 1)) == 0)
+      && (th.textsize <= SHMROOM)
+      && (sizeof th + 2 * nslots * sizeof (uint32_t)
+	  <= SHMROOM - th.textsize))
+    {
+      t.base = (void *) image;
+      t.size = SHMROOM;
+      t.mapped = 0;
+      t.hdr = &th;
+      t.names = (const uint32_t *) (image + sizeof th);
+      t.ids = t.names + nslots;
+      t.text = (const char *) (t.ids + nslots);
+
+      if ((line = table_find (&t, type, key)) != NULL)
+	  *linep = strdup (line);
+    }
+
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+  if ((__atomic_load_n (&hdr->seq, __ATOMIC_RELAXED) != seq)
+      || (expires <= now) || (*linep == NULL))
+    {
+      free (*linep);
+      *linep = NULL;
+      return 0;
+    }
+
+  STAT (STAT_SEGMENT);
+
+  return 1;
+}
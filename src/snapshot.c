@@ -0,0 +1,209 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "nss_external.h"
+
+/*
+ * Snapshots.
+ *
+ * nss_external_snapshot runs each command once for all its entries, and
+ * saves them as a table in snapshot_dir, which the library maps and
+ * answers lookups from without running anything.  As the whole database is
+ * there, a key that isn't in the snapshot doesn't exist.  A snapshot
+ * older than the configured maximum age is ignored, and lookups go to
+ * the command as usual.
+ *
+ * The file is checked for replacement at most once a second.  The
+ * table is only unmapped with the write lock held, so lookups hold the
+ * read lock while they copy an entry out.
+ */
+
+struct snapshot
+{
+  pthread_rwlock_t lock;
+  struct table *table;
+  time_t checked;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+};
+
+static struct snapshot snapshots[NDB] = {
+  { PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0, 0, { 0, 0 } },
+  { PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0, 0, { 0, 0 } },
+  { PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0, 0, { 0, 0 } },
+};
+
+/*
+ * path:
+ *
+ * Where the snapshot for database db lives.
+ */
+
+static void
+path (int db, char *buf, size_t len)
+{
+  snprintf (buf, len, "%s/%s", getconf ()->snapdir, dbnames[db]);
+}
+
+/*
+ * reload:
+ *
+ * Map the snapshot again if the file has been replaced, or drop it if
+ * it's gone.  Called with the write lock held.
+ */
+
+static void
+reload (struct snapshot *sp, int db)
+{
+  char file[PATH_MAX];
+  struct stat sb;
+
+  path (db, file, sizeof file);
+
+  if (stat (file, &sb) < 0)
+    {
+      table_free (sp->table);
+      sp->table = NULL;
+      return;
+    }
+
+  if ((sp->table != NULL) && (sb.st_dev == sp->dev) && (sb.st_ino == sp->ino)
+      && (sb.st_mtim.tv_sec == sp->mtime.tv_sec)
+      && (sb.st_mtim.tv_nsec == sp->mtime.tv_nsec))
+      return;
+
+  table_free (sp->table);
+  sp->table = table_map (file);
+
+  sp->dev = sb.st_dev;
+  sp->ino = sb.st_ino;
+  sp->mtime = sb.st_mtim;
+}
+
+/*
+ * snapshot_get:
+ *
+ * Look key up in the snapshot for database db.  Returns 1 with *linep
+ * set to a malloc'd copy of the entry if it's there, 0 if it isn't, or
+ * -1 if there's no usable snapshot.
+ */
+
+int
+snapshot_get (int db, int type, const char *key, char **linep)
+{
+  struct snapshot *sp = &snapshots[db];
+  time_t maxage = getconf ()->snapmaxage;
+  time_t now = cache_now ();
+  const char *line;
+  int found = -1;
+
+  *linep = NULL;
+
+  if (maxage == 0)
+      return -1;
+
+  if (__atomic_load_n (&sp->checked, __ATOMIC_RELAXED) != now)
+    {
+      pthread_rwlock_wrlock (&sp->lock);
+      if (sp->checked != now)
+	{
+	  reload (sp, db);
+	  __atomic_store_n (&sp->checked, now, __ATOMIC_RELAXED);
+	}
+      pthread_rwlock_unlock (&sp->lock);
+    }
+
+  pthread_rwlock_rdlock (&sp->lock);
+
+  if ((sp->table != NULL)
+      && (time (NULL) - sp->table->hdr->created <= maxage)
+      && ((type == CACHE_NAME) || (db != DB_SHADOW)))
+    {
+      if ((line = table_find (sp->table, type, key)) == NULL)
+	  found = 0;
+      else if ((*linep = strdup (line)) != NULL)
+	  found = 1;
+    }
+
+  pthread_rwlock_unlock (&sp->lock);
+
+  if (found >= 0)
+      STAT (STAT_SNAPSHOT);
+
+  return found;
+}
+
+/*
+ * snapshot_refresh:
+ *
+ * Run the command for database db for all its entries, and replace its
+ * snapshot.  Nothing is written if the command fails or returns
+ * nothing, so a passing problem with the command doesn't leave every
+ * lookup failing.  Returns 0 (with errno set) on failure.
+ */
+
+int
+snapshot_refresh (int db)
+{
+  char file[PATH_MAX];
+  struct table *t;
+  char **lines;
+  int ok;
+
+  if ((lines = cmdrun (db, NOARGS)) == NULL)
+    {
+      errno = EIO;
+      return 0;
+    }
+
+  if (lines[0] == NULL)
+    {
+      cmdclose (lines);
+      errno = ENOENT;
+      return 0;
+    }
+
+  t = table_build (lines, db != DB_SHADOW);
+  cmdclose (lines);
+
+  if (t == NULL)
+    {
+      errno = ENOMEM;
+      return 0;
+    }
+
+  path (db, file, sizeof file);
+  ok = table_write (t, file, (db == DB_SHADOW) ? 0600 : 0644);
+  table_free (t);
+
+  return ok;
+}
@@ -0,0 +1,153 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nss_external.h"
+
+struct stats stats;
+
+static const char *const statnames[NSTATS] = {
+  "getpwnam", "getpwuid", "setpwent", "getpwent",
+  "getgrnam", "getgrgid", "setgrent", "getgrent",
+  "initgroups", "getspnam", "setspent", "getspent",
+  "getpwall", "getgrall", "lookup_async",
+  "spawns", "bytes_read", "timeouts", "parse_failures", "erange",
+  "cache_hits", "cache_misses", "negative_hits", "stale_hits",
+  "stale_fallbacks", "refreshes", "snapshot_answers", "prefetch_answers",
+  "segment_answers", "shared_lookups", "daemon_answers", "daemon_requests",
+  "queued", "rejected",
+};
+
+/*
+ * stats_clock:
+ *
+ * Microseconds on the monotonic clock.
+ */
+
+long long
+stats_clock (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * stats_latency:
+ *
+ * Count a command for database db which started answering at start
+ * (from stats_clock()) and has just finished.  Bucket n holds times
+ * under 2^n microseconds, the last bucket anything longer.
+ */
+
+void
+stats_latency (int db, long long start)
+{
+  long long us = stats_clock () - start;
+  int bucket = 0;
+
+  while ((us > 0) && (bucket < NBUCKETS - 1))
+    {
+      us >>= 1;
+      bucket++;
+    }
+
+  __atomic_add_fetch (&stats.latency[db][bucket], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_format:
+ *
+ * The statistics as malloc'd text, one "name value" line each: every
+ * counter, then the non-empty latency buckets, named for the database
+ * and the bucket's upper bound, as in "passwd_latency_1024us".
+ */
+
+char *
+stats_format (void)
+{
+  unsigned long n;
+  char *text = NULL;
+  size_t size = 0;
+  FILE *fp;
+  int i, db;
+
+  if ((fp = open_memstream (&text, &size)) == NULL)
+      return NULL;
+
+  for (i = 0; i < NSTATS; i++)
+      fprintf (fp, "%s %lu\n", statnames[i],
+	       __atomic_load_n (&stats.counters[i], __ATOMIC_RELAXED));
+
+  for (db = 0; db < NDB; db++)
+      for (i = 0; i < NBUCKETS; i++)
+	  if ((n = __atomic_load_n (&stats.latency[db][i], __ATOMIC_RELAXED)))
+	      fprintf (fp, "%s_latency_%s%lluus %lu\n", dbnames[db],
+		       (i == NBUCKETS - 1) ? "over" : "",
+		       1ULL << ((i == NBUCKETS - 1) ? i - 1 : i), n);
+
+  if (fclose (fp) != 0)
+    {
+      free (text);
+      return NULL;
+    }
+
+  return text;
+}
+
+/*
+ * dump:
+ *
+ * At exit, append the statistics to the file named by NSS_EXTERNAL_STATS
+ * ("-" for stderr), if it's set.  The commands we run inherit it, but
+ * have NSS_EXTERNAL_DISABLE set, so don't dump their own.
+ */
+
+static void __attribute__ ((destructor))
+dump (void)
+{
+  const char *file;
+  char *text;
+  FILE *fp;
+
+  if (((file = secure_getenv (STATSENV)) == NULL) || getenv (DISABLE))
+      return;
+
+  if (strcmp (file, "-") == 0)
+      fp = stderr;
+  else if ((fp = fopen (file, "ae")) == NULL)
+      return;
+
+  if ((text = stats_format ()) != NULL)
+    {
+      fprintf (fp, "pid %d\n%s\n", (int) getpid (), text);
+      free (text);
+    }
+
+  if (fp != stderr)
+      fclose (fp);
+}
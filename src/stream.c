@@ -0,0 +1,416 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "nss_external.h"
+
+/*
+ * Enumerations read the command's output one line at a time, through a
+ * single reusable buffer, rather than collecting it all first.  The
+ * output comes from the daemon's socket (ending with an empty line),
+ * from a pipe from the command (ending at EOF), or, for a co-process,
+ * from its already collected reply.
+ *
+ * An enumeration may take as long as it likes, but if the command goes
+ * quiet for longer than its timeout, it's killed and the enumeration
+ * ends there, with the stream's error flag set so that the caller can
+ * tell it from the real end of the output.  Either way, the command is
+ * reaped as soon as its output ends, rather than when the caller gets
+ * round to closing the stream, so that it no longer counts against
+ * maxprocs.
+ */
+
+struct stream
+{
+  int db;
+  int fd;
+  pid_t pid;			/* command we started, if any */
+  int timeout;
+  int terminated;		/* output ends with an empty line */
+  int eof;
+  int error;			/* errno, if output was cut short */
+  char **file;			/* co-process reply */
+  char **next;
+  char *buf;
+  size_t size;
+  size_t start;			/* current line */
+  size_t end;			/* end of what's been read */
+  size_t pending;		/* if non-zero, where the next line starts */
+};
+
+/*
+ * streamnew:
+ *
+ * Allocate a stream reading from fd.
+ */
+
+static struct stream *
+streamnew (int db, int fd, pid_t pid)
+{
+  struct stream *s;
+
+  if ((s = calloc (1, sizeof (struct stream))) == NULL)
+      return NULL;
+
+  s->db = db;
+  s->fd = fd;
+  s->pid = pid;
+  s->timeout = cmdtimeout (db);
+
+  return s;
+}
+
+/*
+ * streamopen:
+ *
+ * Start enumerating the entries of database db, through the caching
+ * daemon if it's running and we're configured to use it.  Returns NULL
+ * if the command couldn't be run.
+ */
+
+struct stream *
+streamopen (int db)
+{
+  struct stream *s;
+  int fd;
+
+  if ((getconf ()->mode != MODE_DAEMON)
+      || ((fd = daemon_connect (db, NOARGS)) < 0))
+      return streamrun (db);
+
+  if ((s = streamnew (db, fd, 0)) == NULL)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  s->timeout += DAEMONSLACK;
+  s->terminated = 1;
+
+  return s;
+}
+
+/*
+ * streamrun:
+ *
+ * Start enumerating the entries of database db by running its command
+ * ourselves.
+ */
+
+struct stream *
+streamrun (int db)
+{
+  const struct conf *conf = getconf ();
+  const char *command = conf->db[db].command;
+  struct stream *s;
+  char **file;
+  pid_t pid;
+  int fd;
+
+  if (!cmdcheck (command))
+      return NULL;
+
+  if (((conf->mode == MODE_COPROCESS) || secure_getenv (COPROCESS))
+      && ((file = coproc_query (db, NOARGS)) != NULL))
+    {
+      if ((s = streamnew (db, -1, 0)) == NULL)
+	{
+	  cmdclose (file);
+	  return NULL;
+	}
+
+      s->file = s->next = file;
+      return s;
+    }
+
+  if ((fd = cmdexec (db, NOARGS, 1, &pid)) < 0)
+      return NULL;
+
+  if ((s = streamnew (db, fd, pid)) == NULL)
+    {
+      kill (pid, SIGKILL);
+      cmdwait (db, fd, pid);
+      return NULL;
+    }
+
+  cmdlisting (db, 1);
+
+  return s;
+}
+
+/*
+ * finish:
+ *
+ * Reap the command we started, once its output has ended.
+ */
+
+static void
+finish (struct stream *s)
+{
+  if (s->pid > 0)
+    {
+      cmdlisting (s->db, -1);
+      cmdwait (s->db, s->fd, s->pid);
+      s->pid = 0;
+      s->fd = -1;
+    }
+}
+
+/*
+ * streamline:
+ *
+ * Return the current line, without its newline, reading it if need be.
+ * The same line is returned until streamnext() is called, so that a
+ * caller whose buffer was too small can try again.  Returns NULL at
+ * the end of the output, or if it couldn't be read (see streamerror()).
+ */
+
+char *
+streamline (struct stream *s)
+{
+  char *line, *nl;
+  ssize_t n;
+
+  if (s->file != NULL)
+      return *s->next;
+
+  if (s->pending)
+      return s->buf + s->start;
+
+  for (;;)
+    {
+      line = s->buf + s->start;
+
+      if ((s->end > s->start)
+	  && ((nl = memchr (line, '\n', s->end - s->start)) != NULL))
+	{
+	  *nl = '\0';
+
+	  if (nl > line)
+	    {
+	      s->pending = nl + 1 - s->buf;
+	      return line;
+	    }
+
+	  /*
+	   * An empty line ends a reply from the daemon; from a command,
+	   * it's simply skipped.
+	   */
+
+	  s->start++;
+	  if (s->terminated)
+	      s->eof = 1;
+	  else
+	      continue;
+	}
+
+      if (s->eof)
+	{
+	  /*
+	   * A last line without a newline still counts.
+	   */
+
+	  if (!s->terminated && (s->end > s->start))
+	    {
+	      s->buf[s->end] = '\0';
+	      s->pending = s->end;
+	      return line;
+	    }
+
+	  finish (s);
+	  return NULL;
+	}
+
+      /*
+       * Move what's left of the buffer to the front, and read some more.
+       */
+
+      if (s->start > 0)
+	{
+	  memmove (s->buf, s->buf + s->start, s->end - s->start);
+	  s->end -= s->start;
+	  s->start = 0;
+	}
+
+      n = -1;
+      errno = EFBIG;
+
+      if (cmdgrow (&s->buf, &s->size, s->end))
+	  n = cmdread (s->fd, s->buf + s->end, s->size - s->end - 1,
+		       cmdclock () + s->timeout);
+
+      if (n < 0)
+	{
+	  if (s->pid > 0)
+	      kill (s->pid, SIGKILL);
+	  s->eof = 1;
+	  s->error = errno ? errno : EIO;
+	  s->end = s->start;
+	  finish (s);
+	  return NULL;
+	}
+
+      /*
+       * The daemon closes the connection early if the command failed.
+       */
+
+      if (n == 0)
+	{
+	  s->eof = 1;
+	  s->error = s->terminated ? EIO : 0;
+	}
+
+      s->end += n;
+    }
+}
+
+/*
+ * streamerror:
+ *
+ * If the output ended because the command failed, timed out or couldn't
+ * be read, rather than because it was all read, the reason, as an errno
+ * value.  Otherwise 0.
+ */
+
+int
+streamerror (struct stream *s)
+{
+  return s->error;
+}
+
+/*
+ * streamnext:
+ *
+ * Move past the current line.
+ */
+
+void
+streamnext (struct stream *s)
+{
+  if (s->file != NULL)
+    {
+      if (*s->next != NULL)
+	  s->next++;
+    }
+  else if (s->pending)
+    {
+      s->start = s->pending;
+      s->pending = 0;
+    }
+}
+
+/*
+ * streamclose:
+ *
+ * Finish the enumeration, and free everything.  A command that hasn't
+ * finished is killed.
+ */
+
+void
+streamclose (struct stream *s)
+{
+  if (s == NULL)
+      return;
+
+  if (s->pid > 0)
+    {
+      if (!s->eof)
+	  kill (s->pid, SIGKILL);
+      finish (s);
+    }
+  else if (s->fd >= 0)
+      close (s->fd);
+
+  cmdclose (s->file);
+  free (s->buf);
+  free (s);
+}
+
+/*
+ * lineid:
+ *
+ * Read the id, the third field, of a passwd or group line in place.
+ */
+
+static int
+lineid (const char *line, id_t *idp)
+{
+  const char *p, *end;
+  char field[32];
+
+  if (((p = strchr (line, ':')) == NULL)
+      || ((p = strchr (p + 1, ':')) == NULL))
+      return 0;
+
+  end = strchrnul (++p, ':');
+  if ((size_t) (end - p) >= sizeof field)
+      return 0;
+
+  memcpy (field, p, end - p);
+  field[end - p] = '\0';
+
+  return parseid (field, idp);
+}
+
+/*
+ * streamall:
+ *
+ * Enumerate every entry of database db (passwd or group) whose id is at
+ * least floor, calling fn with each line, until it returns non-zero.
+ * The id is checked as the line is read, before it's copied or parsed,
+ * so entries below the floor, and lines without a valid id, cost next
+ * to nothing.  Returns 0, with errno set, if the command couldn't be
+ * run or its output was cut short.
+ */
+
+int
+streamall (int db, id_t floor, int (*fn) (char *line, void *arg), void *arg)
+{
+  struct stream *s;
+  char *line;
+  id_t id;
+  int err;
+
+  if ((s = streamopen (db)) == NULL)
+    {
+      errno = ENOENT;
+      return 0;
+    }
+
+  while ((line = streamline (s)) != NULL)
+    {
+      if (lineid (line, &id) && (id >= floor) && fn (line, arg))
+	  break;
+      streamnext (s);
+    }
+
+  err = streamerror (s);
+  streamclose (s);
+
+  errno = err;
+  return err == 0;
+}
@@ -0,0 +1,408 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "nss_external.h"
+
+/*
+ * Tables are open addressed hash tables, with linear probing, over
+ * entries stored as they came from the command.  Each index has at
+ * least twice as many slots as there are entries, so there's always an
+ * empty slot to end a probe.  Where the command returned more than one
+ * entry for a key, the first one wins.  Ids are taken from the third
+ * field, as in both passwd(5) and group(5).
+ */
+
+#define IDFIELD 2
+
+/*
+ * hash:
+ *
+ * FNV-1a over a name, or over the bytes of an id.
+ */
+
+static uint32_t
+hash (const void *key, size_t len)
+{
+  const unsigned char *p = key;
+  uint32_t h = 2166136261u;
+
+  while (len-- > 0)
+      h = (h ^ *p++) * 16777619u;
+
+  return h;
+}
+
+/*
+ * field:
+ *
+ * Find field n of a line, returning its length, or -1 if there's no
+ * such field.
+ */
+
+static ssize_t
+field (const char *line, int n, const char **fieldp)
+{
+  const char *end;
+
+  for (; n > 0; n--)
+      if ((line = strchr (line, ':')) == NULL)
+	  return -1;
+      else
+	  line++;
+
+  if ((end = strchr (line, ':')) == NULL)
+      end = line + strlen (line);
+
+  *fieldp = line;
+  return end - line;
+}
+
+/*
+ * lineid:
+ *
+ * Parse the id in field n of a line.
+ */
+
+static int
+lineid (const char *line, int n, id_t *idp)
+{
+  char buf[32];
+  const char *f;
+  ssize_t len;
+
+  if (((len = field (line, n, &f)) < 0) || ((size_t) len >= sizeof buf))
+      return 0;
+
+  memcpy (buf, f, len);
+  buf[len] = '\0';
+
+  return parseid (buf, idp);
+}
+
+/*
+ * probe:
+ *
+ * Find the slot for key in an index: either the slot of the entry with
+ * that key, or the empty slot where it would go.  For the id index,
+ * key points to an id_t.  A probe which finds no empty slot, as it may
+ * in a shared table that's being rewritten as we read it, gives up
+ * after every slot, returning nslots.
+ */
+
+static uint32_t
+probe (const struct table *t, const uint32_t *index, int type,
+       const void *key, size_t keylen)
+{
+  uint32_t mask = t->hdr->nslots - 1;
+  uint32_t i = hash (key, keylen) & mask;
+  uint32_t n = 0;
+  const char *line, *f;
+  id_t id;
+
+  for (; index[i] != 0; i = (i + 1) & mask)
+    {
+      if (n++ > mask)
+	  return mask + 1;
+
+      if (index[i] > t->hdr->textsize)
+	  continue;
+
+      line = t->text + index[i] - 1;
+
+      if (type == CACHE_ID)
+	{
+	  if (lineid (line, IDFIELD, &id) && (id == *(const id_t *) key))
+	      break;
+	}
+      else if ((field (line, 0, &f) == (ssize_t) keylen)
+	       && (memcmp (f, key, keylen) == 0))
+	  break;
+    }
+
+  return i;
+}
+
+/*
+ * table_build:
+ *
+ * Build a table from a NULL terminated array of lines.  If byid is set,
+ * the entries are indexed by id as well as by name.  Returns NULL if
+ * memory runs out, or the lines won't fit.
+ */
+
+struct table *
+table_build (char **lines, int byid)
+{
+  struct table_header *hdr;
+  struct table *t;
+  size_t n, nslots, textsize = 0, size, len;
+  uint32_t *names, *ids, i;
+  const char *f;
+  char *text;
+  ssize_t keylen;
+  id_t id;
+
+  for (n = 0; lines[n] != NULL; n++)
+      textsize += strlen (lines[n]) + 1;
+
+  for (nslots = 1; nslots < n * 2; nslots <<= 1);
+
+  if ((textsize >= UINT32_MAX) || (nslots > UINT32_MAX / 2))
+      return NULL;
+
+  size = sizeof (struct table_header) + 2 * nslots * sizeof (uint32_t)
+    + textsize;
+
+  if ((t = calloc (1, sizeof (struct table))) == NULL)
+      return NULL;
+
+  if ((t->base = calloc (1, size)) == NULL)
+    {
+      free (t);
+      return NULL;
+    }
+
+  t->size = size;
+  t->hdr = hdr = t->base;
+  t->names = names = (uint32_t *) (hdr + 1);
+  t->ids = ids = names + nslots;
+  t->text = text = (char *) (ids + nslots);
+
+  hdr->magic = TABLEMAGIC;
+  hdr->version = TABLEVERSION;
+  hdr->created = time (NULL);
+  hdr->nslots = nslots;
+  hdr->textsize = textsize;
+
+  for (n = 0; lines[n] != NULL; n++)
+    {
+      len = strlen (lines[n]) + 1;
+      memcpy (text, lines[n], len);
+
+      if ((keylen = field (text, 0, &f)) > 0)
+	{
+	  i = probe (t, names, CACHE_NAME, f, keylen);
+	  if (names[i] == 0)
+	    {
+	      names[i] = text - t->text + 1;
+	      hdr->count++;
+	    }
+
+	  if (byid && lineid (text, IDFIELD, &id))
+	    {
+	      i = probe (t, ids, CACHE_ID, &id, sizeof id);
+	      if (ids[i] == 0)
+		  ids[i] = text - t->text + 1;
+	    }
+	}
+
+      text += len;
+    }
+
+  return t;
+}
+
+/*
+ * table_find:
+ *
+ * Look up an entry by name (type CACHE_NAME), or by id (CACHE_ID, with
+ * the id as a decimal string).  Returns the entry, or NULL.
+ */
+
+const char *
+table_find (const struct table *t, int type, const char *key)
+{
+  const uint32_t *index;
+  uint32_t i;
+  id_t id;
+
+  if (type == CACHE_ID)
+    {
+      if (!parseid (key, &id))
+	  return NULL;
+
+      index = t->ids;
+      i = probe (t, index, type, &id, sizeof id);
+    }
+  else
+    {
+      index = t->names;
+      i = probe (t, index, type, key, strlen (key));
+    }
+
+  if ((i >= t->hdr->nslots) || (index[i] == 0)
+      || (index[i] > t->hdr->textsize))
+      return NULL;
+
+  return t->text + index[i] - 1;
+}
+
+/*
+ * table_write:
+ *
+ * Write a table to path.  It's written to a temporary file first and
+ * renamed into place, so that readers see either the old table or the
+ * new one, never part of one.
+ */
+
+int
+table_write (const struct table *t, const char *path, mode_t mode)
+{
+  char tmp[PATH_MAX];
+  const char *p = t->base;
+  size_t left = t->size;
+  ssize_t n;
+  int fd;
+
+  if (snprintf (tmp, sizeof tmp, "%s.XXXXXX", path) >= (int) sizeof tmp)
+    {
+      errno = ENAMETOOLONG;
+      return 0;
+    }
+
+  if ((fd = mkostemp (tmp, O_CLOEXEC)) < 0)
+      return 0;
+
+  while (left > 0)
+    {
+      if ((n = write (fd, p, left)) < 0)
+	{
+	  if (errno == EINTR)
+	      continue;
+	  break;
+	}
+      p += n;
+      left -= n;
+    }
+
+  if ((left > 0) || (fchmod (fd, mode) < 0) || (fsync (fd) < 0))
+    {
+      close (fd);
+      unlink (tmp);
+      return 0;
+    }
+
+  if ((close (fd) < 0) || (rename (tmp, path) < 0))
+    {
+      unlink (tmp);
+      return 0;
+    }
+
+  return 1;
+}
+
+/*
+ * table_map:
+ *
+ * Map a table written by table_write() into memory, read only.
+ * Returns NULL if it can't be read, or doesn't look like a table.  As
+ * the table is trusted to say who does and doesn't exist, it must also
+ * be a regular file owned by root, and writable by nobody else.
+ */
+
+struct table *
+table_map (const char *path)
+{
+  const struct table_header *hdr;
+  struct table *t;
+  struct stat sb;
+  void *base;
+  size_t nslots;
+  int fd;
+
+  if ((fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+      return NULL;
+
+  if ((fstat (fd, &sb) < 0) || !S_ISREG (sb.st_mode) || (sb.st_uid != 0)
+      || ((sb.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+      || ((size_t) sb.st_size < sizeof (struct table_header)))
+    {
+      close (fd);
+      return NULL;
+    }
+
+  base = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (base == MAP_FAILED)
+      return NULL;
+
+  /*
+   * Check the sizes add up, and that the last entry is terminated, so
+   * that nothing we do with the table can stray outside it.
+   */
+
+  hdr = base;
+  nslots = hdr->nslots;
+
+  if ((hdr->magic != TABLEMAGIC) || (hdr->version != TABLEVERSION)
+      || (nslots == 0) || ((nslots & (nslots - 1)) != 0)
+      || (hdr->textsize == 0) || (hdr->count >= nslots)
+      || ((size_t) sb.st_size != sizeof (struct table_header)
+	  + 2 * nslots * sizeof (uint32_t) + hdr->textsize)
+      || (((const char *) base)[sb.st_size - 1] != '\0')
+      || ((t = calloc (1, sizeof (struct table))) == NULL))
+    {
+      munmap (base, sb.st_size);
+      return NULL;
+    }
+
+  t->base = base;
+  t->size = sb.st_size;
+  t->mapped = 1;
+  t->hdr = hdr;
+  t->names = (const uint32_t *) (hdr + 1);
+  t->ids = t->names + nslots;
+  t->text = (const char *) (t->ids + nslots);
+
+  return t;
+}
+
+/*
+ * table_free:
+ *
+ * Free or unmap a table.
+ */
+
+void
+table_free (struct table *t)
+{
+  if (t == NULL)
+      return;
+
+  if (t->mapped)
+      munmap (t->base, t->size);
+  else
+      free (t->base);
+
+  free (t);
+}
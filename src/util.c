@@ -22,158 +22,813 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <spawn.h>
+
+extern char **environ;
 
 #include "nss_external.h"
 
+/*
+ * The commands running for lookups, per database.
+ */
+
+static struct pool spawns[NDB] = {
+  POOL_INITIALIZER, POOL_INITIALIZER, POOL_INITIALIZER
+};
+
+/*
+ * Enumerations whose command is still running, per database.  Their
+ * commands count against maxprocs like any other, but other commands
+ * aren't made to wait for them: an enumeration holds its turn until the
+ * caller gets to the end, and a program which looks entries up in the
+ * middle of one would otherwise wait for itself.
+ */
+
+static int listings[NDB];
+
 /*
  * cmdopen:
  *
- * Sanity check and open command
+ * Get the output of the command for database db and the NULL terminated
+ * arguments args (a single key, an option and its values, or nothing to
+ * list every entry), from the caching daemon if it's running (and we
+ * haven't been configured not to ask it), otherwise by running the
+ * command ourselves.  Returns a NULL terminated array of output lines,
+ * or NULL if the command couldn't be run.
  */
 
 char **
-cmdopen (const char *command, char *arg)
+cmdopen (int db, char *const args[])
 {
-  struct stat sb;
-  FILE *fcmd = NULL;
-  char cmd[CMDSIZ];
-  char **file = NULL;
-  char *line = NULL;
-  int c, len = 0, pos = 0, nlines = 0;
+  char **file;
+
+  if ((getconf ()->mode == MODE_DAEMON) && daemon_query (db, args, &file))
+    {
+      STAT (STAT_DAEMON);
+      return file;
+    }
+
+  return cmdrun (db, args);
+}
+
+/*
+ * cmdbatch:
+ *
+ * Look up an id in the passwd or group database, and, if the command
+ * is configured to take several keys at once, prefetch the ids
+ * following it that aren't already cached, in the same call.  Entries
+ * for the other ids go into cache c, and those the command didn't know
+ * into neg.  Returns the command's output in the form cmdopen() does,
+ * with the entry for id (if any) first and the others removed, or NULL
+ * if the command couldn't be run.
+ */
+
+char **
+cmdbatch (int db, const char *id, struct cache *c, struct cache *neg)
+{
+  int batch = getconf ()->db[db].batch;
+  char keys[MAXBATCH][32], key[32], *fields[4], *line, *copy, *cached;
+  char *args[MAXBATCH + 2] = { BATCHARG, (char *) id };
+  char seen[MAXBATCH];
+  char **file, **fp;
+  id_t wanted, found;
+  int i, n = 2;
+
+  if ((batch <= 1) || !parseid (id, &wanted) || (wanted > (id_t) -1 - batch))
+      return cmdopen (db, KEYARGS (id));
 
   /*
-   * Do we have the command to execute?
+   * Ask for the id wanted, and the uncached ids after it.  seen[i]
+   * tracks wanted + i: -1 if we didn't ask for it, 0 if we did and it
+   * hasn't turned up.
    */
 
-  if (!((stat (command, &sb) == 0) && (sb.st_mode > 0)
-       && (S_IEXEC & sb.st_mode)))
+  memset (seen, -1, sizeof seen);
+
+  for (i = 1; i < batch; i++)
+    {
+      snprintf (keys[i], sizeof keys[i], "%u", (unsigned) (wanted + i));
+
+      if (cache_get (c, CACHE_ID, keys[i], &cached)
+	  || cache_get (neg, CACHE_ID, keys[i], &cached))
+	{
+	  free (cached);
+	  continue;
+	}
+
+      args[n++] = keys[i];
+      seen[i] = 0;
+    }
+
+  args[n] = NULL;
+
+  if (n == 2)
+      return cmdopen (db, KEYARGS (id));
+
+  if ((file = cmdopen (db, args)) == NULL)
       return NULL;
 
   /*
-   * Make sure command doesn't overflow
+   * Cache the entries we weren't asked for under both keys, and keep
+   * the one we were.
    */
 
-  if (snprintf (cmd, sizeof cmd, "%s=1 %s %s", DISABLE, command, arg) >= CMDSIZ)
+  for (line = NULL, fp = file; *fp != NULL; fp++)
+    {
+      if ((copy = strdup (*fp)) == NULL)
+	  continue;
+
+      if ((splitfields (copy, fields, 4) >= 3) && parseid (fields[2], &found))
+	{
+	  if (found == wanted)
+	    {
+	      if (line == NULL)
+		  line = *fp;
+	    }
+	  else
+	    {
+	      if ((found > wanted) && (found - wanted < (id_t) batch))
+		  seen[found - wanted] = 1;
+
+	      cache_line (c, db, *fp);
+	    }
+	}
+
+      free (copy);
+    }
+
+  /*
+   * Anything else we asked for doesn't exist.
+   */
+
+  for (i = 1; i < batch; i++)
+      if (seen[i] == 0)
+	{
+	  snprintf (key, sizeof key, "%u", (unsigned) (wanted + i));
+	  cache_put (neg, CACHE_ID, key, "");
+	}
+
+  file[0] = line;
+  if (line != NULL)
+      file[1] = NULL;
+
+  return file;
+}
+
+/*
+ * cmdexec:
+ *
+ * Run the command for database db with args, directly rather than
+ * through a shell, so that each argument is passed as is.  The
+ * command's stdin is /dev/null.  Like every command we run, it takes a
+ * turn in the database's pool, so that no more than maxprocs run at
+ * once; if queue is set, we wait in line for it, otherwise we give up
+ * straight away when the pool is full.  Returns the read end of a pipe
+ * from its stdout, with its pid in *pidp, or -1 if it couldn't be
+ * started.  The command must be finished with cmdwait().
+ */
+
+int
+cmdexec (int db, char *const args[], int queue, pid_t *pidp)
+{
+  const struct conf *conf = getconf ();
+  const char *command = conf->db[db].command;
+  char *argv[MAXBATCH + 3] = { (char *) command };
+  int argc = 1, fd, limit;
+
+  for (; *args != NULL; args++)
+    {
+      if (argc == MAXBATCH + 2)
+	  return -1;
+      argv[argc++] = *args;
+    }
+
+  argv[argc] = NULL;
+
+  if ((limit = conf->db[db].maxprocs) > 0)
+      limit += __atomic_load_n (&listings[db], __ATOMIC_RELAXED);
+
+  if (!pool_enter (&spawns[db], limit, queue ? conf->db[db].queue : 0,
+		   queue ? cmdtimeout (db) : 0))
+      return -1;
+
+  if ((*pidp = cmdspawn (command, argv, 0, &fd)) < 0)
+    {
+      pool_leave (&spawns[db]);
+      return -1;
+    }
+
+  return fd;
+}
+
+/*
+ * cmdlisting:
+ *
+ * Count an enumeration's command, started by cmdexec(), in or (with n
+ * -1) out of the enumerations running for database db.
+ */
+
+void
+cmdlisting (int db, int n)
+{
+  __atomic_add_fetch (&listings[db], n, __ATOMIC_RELAXED);
+}
+
+/*
+ * cmdfork:
+ *
+ * Hold the pools' locks across a fork(), as for pool_fork().
+ */
+
+void
+cmdfork (int stage)
+{
+  int db;
+
+  for (db = 0; db < NDB; db++)
+      pool_fork (&spawns[db], stage);
+}
+
+/*
+ * cmdwait:
+ *
+ * Close the pipe from a command for database db started by cmdexec()
+ * (unless it's already been closed, and fd is -1), reap it, and give
+ * its turn to the next in line.
+ */
+
+void
+cmdwait (int db, int fd, pid_t pid)
+{
+  if (fd >= 0)
+      close (fd);
+
+  while ((waitpid (pid, NULL, 0) < 0) && (errno == EINTR));
+  pool_leave (&spawns[db]);
+}
+
+/*
+ * cmdreap:
+ *
+ * As cmdwait(), but without waiting for the command to exit.  Returns
+ * 1 once it's been reaped (or if it isn't ours to reap), or 0 if it's
+ * still running, in which case call again later, with fd -1.
+ */
+
+int
+cmdreap (int db, int fd, pid_t pid)
+{
+  pid_t r;
+
+  if (fd >= 0)
+      close (fd);
+
+  while (((r = waitpid (pid, NULL, WNOHANG)) < 0) && (errno == EINTR));
+
+  if (r == 0)
+      return 0;
+
+  pool_leave (&spawns[db]);
+  return 1;
+}
+
+/*
+ * cmdcheck:
+ *
+ * Do we have the command to execute?
+ */
+
+int
+cmdcheck (const char *command)
+{
+  struct stat sb;
+
+  return ((stat (command, &sb) == 0) && (sb.st_mode > 0)
+	  && (S_IEXEC & sb.st_mode));
+}
+
+/*
+ * cmdclock:
+ *
+ * Milliseconds on the monotonic clock, for timeouts.
+ */
+
+long long
+cmdclock (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * cmdtimeout:
+ *
+ * How long, in milliseconds, the command for database db may take to
+ * answer.
+ */
+
+int
+cmdtimeout (int db)
+{
+  return getconf ()->db[db].timeout;
+}
+
+/*
+ * cmdread:
+ *
+ * read() from fd, but give up if nothing has arrived by deadline (from
+ * cmdclock()).  Returns -1 with errno set to ETIMEDOUT in that case.
+ */
+
+ssize_t
+cmdread (int fd, char *buf, size_t len, long long deadline)
+{
+  struct pollfd pfd;
+  long long left;
+  ssize_t n;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  for (;;)
+    {
+      if ((left = deadline - cmdclock ()) <= 0)
+	{
+	  STAT (STAT_TIMEOUTS);
+	  errno = ETIMEDOUT;
+	  return -1;
+	}
+
+      if ((n = poll (&pfd, 1, left > INT_MAX ? INT_MAX : (int) left)) <= 0)
+	{
+	  if ((n < 0) && (errno != EINTR))
+	      return -1;
+	  continue;
+	}
+
+      if ((n = read (fd, buf, len)) >= 0)
+	{
+	  STATADD (STAT_BYTES, n);
+	  return n;
+	}
+
+      if ((errno != EINTR) && (errno != EAGAIN))
+	  return -1;
+    }
+}
+
+/*
+ * cmdgrow:
+ *
+ * Make sure there's room to read at least BUFSIZ more bytes into the
+ * buffer, doubling it as needed.  Returns 0 if it couldn't be grown,
+ * or if it already holds the configured maximum output.
+ */
+
+int
+cmdgrow (char **bufp, size_t *sizep, size_t len)
+{
+  size_t size = *sizep;
+  char *tmp;
+
+  if (size - len >= BUFSIZ)
+      return 1;
+
+  if (len >= getconf ()->maxoutput)
+      return 0;
+
+  size = size ? size * 2 : READSIZ;
+  if ((tmp = realloc (*bufp, size)) == NULL)
+      return 0;
+
+  *bufp = tmp;
+  *sizep = size;
+
+  return 1;
+}
+
+/*
+ * cmdrun:
+ *
+ * Sanity check and open the command for database db.  No more than the
+ * configured maxprocs commands run at once for each database; other
+ * lookups wait in line for their turn (see cmdexec()).
+ */
+
+char **
+cmdrun (int db, char *const args[])
+{
+  const struct conf *conf = getconf ();
+  const char *command = conf->db[db].command;
+  long long start = stats_clock ();
+  char **file = NULL;
+  char *buf = NULL;
+  size_t len = 0, size = 0;
+  long long deadline;
+  ssize_t n;
+  pid_t pid;
+  int fd;
+
+  if (!cmdcheck (command))
       return NULL;
 
   /*
-   * Call fflush before the popen command to make sure we're not
-   * interfering with any buffered i/o currently in progress.
+   * If we've been asked to, try the long running co-process first.
    */
 
-  fflush (NULL);
-  if ((fcmd = popen (cmd, "r")) == NULL)
+  if (((conf->mode == MODE_COPROCESS) || secure_getenv (COPROCESS))
+      && ((file = coproc_query (db, args)) != NULL))
+    {
+      stats_latency (db, start);
+      return file;
+    }
+
+  if ((fd = cmdexec (db, args, 1, &pid)) < 0)
       return NULL;
 
   /*
-   * Read the output of the command, insert into a array of null-terminated
-   * strings.
+   * Read the output of the command in large chunks, and split it into
+   * lines once it's all there.  If it takes too long, or says too much,
+   * kill it and give up.
    */
 
-  while ((c = fgetc (fcmd)) != EOF)
+  deadline = cmdclock () + cmdtimeout (db);
+
+  for (;;)
     {
-      if (c != '\n')
+      if (!cmdgrow (&buf, &size, len)
+	  || ((n = cmdread (fd, buf + len, size - len, deadline)) < 0))
 	{
-	  if (pos >= (len - 1))	/* leave room for NULL terminator */
-	    {
-	      char *tmpline;
-
-	      len += CHUNKSIZ;
-	      tmpline = realloc (line, len);
-	      if (tmpline == NULL)
-		  BAIL;
-	      line = tmpline;
-	    }
-	  line[pos++] = c;
+	  kill (pid, SIGKILL);
+	  break;
 	}
-      else
+
+      if (n == 0)
 	{
-	  char **tmpfile;
-
-	  line[pos] = '\0';
-	  tmpfile = realloc (file, (++nlines + 1) * sizeof (char *));	/* +1 for terminating null */
-	  if (tmpfile == NULL)
-              BAIL;
-	  file = tmpfile;
-	  file[nlines - 1] = line;
-          file[nlines] = line = NULL;
-	  pos = len = 0;
+	  file = splitlines (buf, len);
+	  buf = NULL;
+	  break;
 	}
+
+      len += n;
     }
 
-  pclose (fcmd);
+  free (buf);
+  cmdwait (db, fd, pid);
+  stats_latency (db, start);
+
   return file;
 }
 
+/*
+ * cmdjoin:
+ *
+ * Join args into buf, separated by spaces, for the line based protocols
+ * spoken to co-processes and the daemon.  Returns the length, or -1 if
+ * it won't fit, or an argument holds a newline.
+ */
+
+int
+cmdjoin (char *const args[], char *buf, size_t size)
+{
+  size_t len = 0;
+  int i, n;
+
+  *buf = '\0';
+
+  for (i = 0; args[i] != NULL; i++)
+    {
+      if (strchr (args[i], '\n') != NULL)
+	  return -1;
+
+      n = snprintf (buf + len, size - len, "%s%s", (i > 0) ? " " : "",
+		    args[i]);
+      if ((n < 0) || ((size_t) n >= size - len))
+	  return -1;
+
+      len += n;
+    }
+
+  return (int) len;
+}
+
+/*
+ * validkey:
+ *
+ * Can key be asked for?  A key which is empty, or looks like an option,
+ * or holds white space, could be taken for something other than a
+ * single key by the command, so it's never passed on.
+ */
+
+int
+validkey (const char *key)
+{
+  const char *p;
+
+  if ((*key == '\0') || (*key == '-'))
+      return 0;
+
+  for (p = key; *p != '\0'; p++)
+      if (isspace ((unsigned char) *p))
+	  return 0;
+
+  return 1;
+}
+
 /*
  * cmdclose
  *
- * free all the strings generated from executing the command.
+ * free the output of the command.  The lines and the array pointing to
+ * them are a single allocation.
  */
 
 void
 cmdclose (char **f)
 {
-  char **fp;
+  free (f);
+}
+
+/*
+ * splitlines:
+ *
+ * Given a malloc'd buffer holding len bytes of newline separated lines,
+ * return a NULL terminated array of strings in the form cmdopen()
+ * returns, to be freed with cmdclose().  Empty lines are dropped.
+ *
+ * The array and the text are kept in a single allocation: buf is grown
+ * to make room for the array, and the text moved up behind it, so buf
+ * belongs to the result (or is freed on failure).  If the buffer held
+ * nothing, the result is an empty array.
+ */
+
+char **
+splitlines (char *buf, size_t len)
+{
+  char **file, *text, *p, *end, *nl;
+  size_t nlines = 1, header;
 
-  if (!f)
-      return;
+  for (p = buf, end = buf + len; (p < end)
+       && ((nl = memchr (p, '\n', end - p)) != NULL); p = nl + 1)
+      nlines++;
 
-  for (fp = f; *fp != NULL; fp++)
-      free (*fp);
-  free (f);
+  header = (nlines + 1) * sizeof (char *);
+
+  if ((file = realloc (buf, header + len + 1)) == NULL)
+    {
+      free (buf);
+      return NULL;
+    }
+
+  text = (char *) file + header;
+  memmove (text, file, len);
+  text[len] = '\0';
+
+  for (nlines = 0, p = text, end = text + len; p < end; p = nl + 1)
+    {
+      if ((nl = memchr (p, '\n', end - p)) == NULL)
+	  nl = end;
+
+      *nl = '\0';
+
+      if (nl > p)
+	  file[nlines++] = p;
+    }
+
+  file[nlines] = NULL;
+
+  return file;
 }
 
 /*
- * split:
- * When passed a buffer that contains newline separated strings,
- * and a character to split on, allocate an array of character
- * pointers, and initialize to the beginnings of each line.  Any
- * occurance of the "delim" character is turned into a '\0'
+ * cmdreply:
+ *
+ * Read a reply made up of zero or more lines followed by an empty line,
+ * as spoken by co-processes and the caching daemon.  Returns NULL if
+ * the other end went away, or took longer than timeout milliseconds,
+ * before the reply was complete.
  */
 
 char **
-split (char *buffer, const char *delim)
+cmdreply (int fd, int timeout)
 {
-  char **array, **ap;
+  char *buf = NULL, *end = NULL;
+  size_t len = 0, size = 0, scan;
+  long long deadline = cmdclock () + timeout;
+  ssize_t n;
+
+  while (end == NULL)
+    {
+      if (!cmdgrow (&buf, &size, len)
+	  || ((n = cmdread (fd, buf + len, size - len, deadline)) <= 0))
+	  break;
+
+      /*
+       * An empty reply is a lone newline, otherwise look for the
+       * empty line following the last entry, starting from the last
+       * byte we'd already seen.
+       */
+
+      scan = (len > 0) ? len - 1 : 0;
+      len += n;
+
+      if (buf[0] == '\n')
+	  end = buf;
+      else
+	  end = memmem (buf + scan, len - scan, "\n\n", 2);
+    }
+
+  if (end == NULL)
+    {
+      free (buf);
+      return NULL;
+    }
+
+  return splitlines (buf, end - buf);
+}
+
+/*
+ * cmdspawn:
+ *
+ * Start command with the given argument vector, and with
+ * NSS_EXTERNAL_DISABLE set so it can't recurse into us.  The minimum
+ * uid and gid are passed in NSS_EXTERNAL_MINUID and NSS_EXTERNAL_MINGID,
+ * so that the command can leave out entries we'd ignore.  If duplex is
+ * set, the child's stdin and stdout are both connected to a socket,
+ * otherwise its stdout is a pipe and its stdin is /dev/null.  The
+ * socket or the read end of the pipe is returned in *fdp.  The child
+ * starts with no signals blocked and every signal at its default, so
+ * that it doesn't inherit a mask set by the thread running it (see
+ * refresh_start()), or the caller's handlers.  Returns the child's
+ * pid, or -1 on failure.
+ */
+
+pid_t
+cmdspawn (const char *command, char *const argv[], int duplex, int *fdp)
+{
+  const struct conf *conf = getconf ();
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t none, all;
+  char minuid[32], mingid[32];
+  char **envp;
+  size_t i, n;
+  int fds[2];
+  pid_t pid;
+
+  for (n = 0; environ[n] != NULL; n++);
+
+  if ((envp = calloc (n + 4, sizeof (char *))) == NULL)
+      return -1;
+
+  for (i = n = 0; environ[i] != NULL; i++)
+      if ((strncmp (environ[i], MINUIDENV "=", sizeof MINUIDENV) != 0)
+	  && (strncmp (environ[i], MINGIDENV "=", sizeof MINGIDENV) != 0))
+	  envp[n++] = environ[i];
+
+  snprintf (minuid, sizeof minuid, MINUIDENV "=%u", (unsigned) conf->minuid);
+  snprintf (mingid, sizeof mingid, MINGIDENV "=%u", (unsigned) conf->mingid);
+
+  envp[n++] = DISABLE "=1";
+  envp[n++] = minuid;
+  envp[n++] = mingid;
+
+  if ((duplex ? socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)
+	      : pipe2 (fds, O_CLOEXEC)) < 0)
+    {
+      free (envp);
+      return -1;
+    }
+
+  posix_spawn_file_actions_init (&fa);
+
+  if (duplex)
+      posix_spawn_file_actions_adddup2 (&fa, fds[1], STDIN_FILENO);
+  else
+      posix_spawn_file_actions_addopen (&fa, STDIN_FILENO, "/dev/null",
+					O_RDONLY, 0);
+
+  posix_spawn_file_actions_adddup2 (&fa, fds[1], STDOUT_FILENO);
+
+  sigemptyset (&none);
+  sigfillset (&all);
+  posix_spawnattr_init (&attr);
+  posix_spawnattr_setsigmask (&attr, &none);
+  posix_spawnattr_setsigdefault (&attr, &all);
+  posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK
+			    | POSIX_SPAWN_SETSIGDEF);
+
+  if (posix_spawn (&pid, command, &fa, &attr, argv, envp) != 0)
+      pid = -1;
+
+  posix_spawnattr_destroy (&attr);
+  posix_spawn_file_actions_destroy (&fa);
+  free (envp);
+  close (fds[1]);
+
+  if (pid < 0)
+      close (fds[0]);
+  else
+    {
+      STAT (STAT_SPAWNS);
+      *fdp = fds[0];
+    }
+
+  return pid;
+}
+
+/*
+ * splitfields:
+ *
+ * Split a line in place on ':', storing a pointer to the start of each
+ * field in fields.  No more than nfields pointers are stored; returns
+ * the number of fields found, so a result greater than nfields means
+ * there were too many.
+ */
+
+int
+splitfields (char *line, char **fields, int nfields)
+{
+  int n = 0;
   char *p;
-  size_t size = 0;
 
-  /*
-   * Trivial case; buffer == NULL or *buffer = '\0', return a single
-   * pointer array NULL terminated.
-   */
+  for (;;)
+    {
+      if (n < nfields)
+	  fields[n] = line;
+      n++;
 
-  if ((buffer == NULL) || (*buffer == '\0'))
-      return calloc (1, sizeof (char *));
+      if (((p = strchr (line, ':')) == NULL) || (n > nfields))
+	  break;
 
-  /*
-   * Take a quick pass through the buffer and count the number
-   * of delim characters.
-   */
+      *p = '\0';
+      line = p + 1;
+    }
 
-  for (p = buffer; *p != '\0'; p++)
-      if (*p == *delim)
-	  size++;
+  return n;
+}
 
-  /*
-   * We'll need 2 more than the delim count: also want a null
-   * terminator on the end of the array.
-   */
+/*
+ * parseid:
+ *
+ * Strictly parse a uid or gid: digits only, and in range.
+ */
 
-  if ((array = calloc (size + 2, sizeof (char *))) == NULL)
-      return NULL;
+int
+parseid (const char *s, id_t *idp)
+{
+  unsigned long l;
+  char *end;
 
-  /*
-   * Delimit the array.
-   */
+  if ((*s < '0') || (*s > '9'))
+      return 0;
+
+  errno = 0;
+  l = strtoul (s, &end, 10);
+
+  if ((errno != 0) || (*end != '\0') || (l >= (unsigned long) (id_t) -1))
+      return 0;
+
+  *idp = (id_t) l;
+  return 1;
+}
+
+/*
+ * parselong:
+ *
+ * Strictly parse a shadow(5) numeric field.  Empty fields are -1.
+ */
+
+int
+parselong (const char *s, long *lp)
+{
+  char *end;
+
+  if (*s == '\0')
+    {
+      *lp = -1;
+      return 1;
+    }
+
+  if ((*s < '0') || (*s > '9'))
+      return 0;
 
-  for (ap = array, p = buffer; (*ap = strsep (&p, delim)) != NULL; ap++);
+  errno = 0;
+  *lp = strtol (s, &end, 10);
 
-  return array;
+  return (errno == 0) && (*end == '\0');
 }
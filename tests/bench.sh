@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Benchmark the module against the mock commands.
+#
+#   BENCH_SIZES  database sizes to try (default "1000 100000")
+#   BENCH_COUNT  lookups timed where answers are cached (default 100000)
+#   BENCH_RUNS   lookups timed where every one runs a command (default 200)
+#   MOCK_DELAY   seconds each command takes to answer (default 0)
+
+srcdir=${srcdir:-.}
+top_builddir=${top_builddir:-..}
+. "$srcdir/common.sh"
+
+count=${BENCH_COUNT:-100000}
+runs=${BENCH_RUNS:-200}
+
+for size in ${BENCH_SIZES:-1000 100000}
+do
+  MOCK_ENTRIES=$size
+  export MOCK_ENTRIES
+  last=$((size - 1))
+
+  echo "== $size entries"
+
+  echo "-- cached, 100 keys"
+  configure
+  "$DRIVER" -b -n "$count" "$MODULE" pwnam=0-99 pwuid=0-99 grgid=0-99
+
+  echo "-- uncached, running the command"
+  configure "passwd_cachesize 0" "group_cachesize 0"
+  "$DRIVER" -b -n "$runs" "$MODULE" pwnam=0-$last grgid=0-$last
+
+  echo "-- uncached, co-process"
+  configure "mode coprocess" "passwd_cachesize 0" "group_cachesize 0"
+  "$DRIVER" -b -n "$runs" "$MODULE" pwnam=0-$last grgid=0-$last
+
+  echo "-- batches of 16"
+  configure "passwd_batch 16" "group_batch 16"
+  "$DRIVER" -b -n "$runs" "$MODULE" pwuid=0-$last grgid=0-$last
+
+  echo "-- prefetched"
+  configure "passwd_prefetch 1" "group_prefetch 1"
+  "$DRIVER" -b -n "$count" "$MODULE" pwuid=0-$last grgid=0-$last
+
+  echo "-- enumeration"
+  configure
+  "$DRIVER" -b -n 3 "$MODULE" pwent grent
+done
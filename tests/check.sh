@@ -0,0 +1,340 @@
+#!/bin/sh
+#
+# Check the module's answers against the mock commands, under each of
+# the ways it can be configured to run them.
+
+srcdir=${srcdir:-.}
+top_builddir=${top_builddir:-..}
+. "$srcdir/common.sh"
+
+MOCK_ENTRIES=20
+export MOCK_ENTRIES
+
+failed=0
+
+# expect output [driver argument...]
+
+expect ()
+{
+  want=$1
+  shift
+  got=$("$DRIVER" "$@" 2>&1)
+
+  if [ "$got" != "$want" ]
+  then
+    echo "FAIL: $*"
+    echo "  expected: $want"
+    echo "  got:      $got"
+    failed=1
+  fi
+}
+
+user1="user1:x:1001:1001:User 1:/home/user1:/bin/sh"
+user2="user2:x:1002:1002:User 2:/home/user2:/bin/sh"
+
+keyed ()
+{
+  echo "checking: ${*:-defaults}"
+  configure "$@"
+
+  expect "$user1" "$MODULE" pwnam=user1
+  expect "$user2" "$MODULE" pwuid=1002
+  expect "$user1
+$user1
+$user2" "$MODULE" pwnam=user1 pwuid=1001 pwnam=user2
+  expect NOTFOUND "$MODULE" pwnam=nobody
+  expect NOTFOUND "$MODULE" pwuid=1020
+  expect NOTFOUND "$MODULE" pwuid=99
+  expect "group3:x:1003:user3,user4" "$MODULE" grnam=group3
+  expect "group19:x:1019:user19,user0" "$MODULE" grgid=1019
+  expect NOTFOUND "$MODULE" grnam=user1
+  expect "$(printf "NOTFOUND\nNOTFOUND")" "$MODULE" "pwnam=--batch 1003" "grnam=--member user5"
+  expect "$(printf "NOTFOUND\nNOTFOUND")" "$MODULE" "pwnam=user1 user2" pwnam=-user1
+  expect ERANGE -s 16 "$MODULE" grgid=1001
+  expect "1004 1005" "$MODULE" initgroups=user5:1000
+
+  if [ "$(id -u)" = 0 ]
+  then
+    expect 'user1:$6$mock$1:19000' "$MODULE" spnam=user1
+  else
+    expect UNAVAIL "$MODULE" spnam=user1
+  fi
+}
+
+keyed
+keyed "passwd_cachesize 0" "group_cachesize 0"
+keyed "mode coprocess"
+keyed "mode coprocess" "passwd_workers 4" "group_workers 4"
+keyed "passwd_maxprocs 1" "group_maxprocs 1"
+keyed "passwd_batch 8" "group_batch 8"
+keyed "passwd_prefetch 1" "group_prefetch 1"
+
+echo "checking: enumeration"
+configure
+[ "$("$DRIVER" "$MODULE" pwent | wc -l)" = 20 ] || { echo "FAIL: pwent"; failed=1; }
+[ "$("$DRIVER" "$MODULE" grent | wc -l)" = 20 ] || { echo "FAIL: grent"; failed=1; }
+getall=$top_builddir/src/nss_external_getall
+[ "$("$getall" passwd)" = "$("$DRIVER" "$MODULE" pwent)" ] || { echo "FAIL: getall passwd"; failed=1; }
+[ "$("$getall" group | wc -l)" = 20 ] || { echo "FAIL: getall group"; failed=1; }
+configure "minuid 1015"
+[ "$("$getall" passwd | wc -l)" = 5 ] || { echo "FAIL: getall minuid"; failed=1; }
+
+echo "checking: failures"
+configure "passwd_command /nonexistent"
+expect UNAVAIL "$MODULE" pwnam=user1
+configure "passwd_timeout 200"
+MOCK_DELAY=2
+export MOCK_DELAY
+expect UNAVAIL "$MODULE" pwnam=user1
+expect UNAVAIL "$MODULE" pwent
+"$getall" passwd >/dev/null 2>&1 && { echo "FAIL: getall timeout"; failed=1; }
+unset MOCK_DELAY
+
+# stats file statistic...: check the statistics dumped to file
+
+stats ()
+{
+  file=$1
+  shift
+  for stat in "$@"
+  do
+    grep -qx "$stat" "$file" || { echo "FAIL: stats: $stat"; failed=1; }
+  done
+}
+
+echo "checking: asynchronous lookups"
+configure
+got=$("$DRIVER" -a "$MODULE" pwnam=user1 pwuid=1002 grgid=1019 pwnam=nobody pwuid=99 | sort)
+want=$(printf '%s\n' "$user1" "$user2" "group19:x:1019:user19,user0" NOTFOUND NOTFOUND | sort)
+[ "$got" = "$want" ] || { echo "FAIL: async"; echo "  got: $got"; failed=1; }
+configure "passwd_command /nonexistent"
+expect UNAVAIL -a "$MODULE" pwnam=user1
+configure
+MOCK_LOG=$work/async
+export MOCK_LOG
+expect "$user1
+$user1
+NOTFOUND
+NOTFOUND" -a "$MODULE" pwnam=user1 sleep=0 pwnam=user1 sleep=0 pwnam=nobody sleep=0 pwnam=nobody
+unset MOCK_LOG
+[ "$(wc -l < "$work/async")" = 2 ] || { echo "FAIL: async cache"; failed=1; }
+configure "passwd_maxprocs 1"
+got=$(MOCK_DELAY=1 "$DRIVER" -a "$MODULE" pwnam=user1 pwnam=user2 | sort)
+want=$(printf '%s\n' "$user1" UNAVAIL | sort)
+[ "$got" = "$want" ] || { echo "FAIL: async maxprocs"; echo "  got: $got"; failed=1; }
+cat > "$work/digits" <<'EOF'
+#!/bin/sh
+case "$1" in
+  42|1500) echo "42:x:1500:1500::/:/bin/sh" ;;
+esac
+EOF
+chmod +x "$work/digits"
+configure "passwd_command $work/digits"
+expect "42:x:1500:1500::/:/bin/sh
+42:x:1500:1500::/:/bin/sh" -a "$MODULE" pwnam=42 sleep=0 pwuid=1500
+
+echo "checking: lookups during an enumeration"
+configure "passwd_maxprocs 1" "passwd_queue 0" "passwd_cachesize 0"
+got=$("$DRIVER" "$MODULE" pwent=user1 | tail -n 1)
+[ "$got" = "$user1" ] || { echo "FAIL: pwent=user1"; echo "  got: $got"; failed=1; }
+
+echo "checking: malformed gids"
+cat > "$work/badgroup" <<'EOF'
+#!/bin/sh
+# Answers --member for user1 only, so user2 goes through the index.
+[ "$2" = user2 ] && exit 0
+echo "bad:x:1001x:user1,user2"
+echo "good:x:1003:user1,user2"
+EOF
+chmod +x "$work/badgroup"
+configure "group_command $work/badgroup"
+expect 1003 "$MODULE" initgroups=user1:1000
+expect 1003 "$MODULE" initgroups=user2:1000
+
+echo "checking: ids above INT_MAX"
+cat > "$work/bigpasswd" <<'EOF'
+#!/bin/sh
+case "$1" in
+  big|3000000000) echo "big:x:3000000000:3000000000:Big:/:/bin/sh" ;;
+esac
+EOF
+cat > "$work/biggroup" <<'EOF'
+#!/bin/sh
+case "$1" in
+  bigs|3000000000) echo "bigs:x:3000000000:" ;;
+esac
+EOF
+chmod +x "$work/bigpasswd" "$work/biggroup"
+configure "passwd_command $work/bigpasswd" "group_command $work/biggroup" \
+  "passwd_batch 1" "group_batch 1"
+expect "big:x:3000000000:3000000000:Big:/:/bin/sh
+big:x:3000000000:3000000000:Big:/:/bin/sh" "$MODULE" pwuid=3000000000 pwnam=big
+expect "bigs:x:3000000000:" "$MODULE" grgid=3000000000
+expect "big:x:3000000000:3000000000:Big:/:/bin/sh
+big:x:3000000000:3000000000:Big:/:/bin/sh" "$MODULE" pwnam=big pwuid=3000000000
+
+echo "checking: group_member"
+for member in 0 1
+do
+  configure "group_member $member"
+  MOCK_LOG=$work/member$member
+  export MOCK_LOG
+  expect NOTFOUND "$MODULE" initgroups=user25:1000
+  unset MOCK_LOG
+done
+[ "$(wc -l < "$work/member0")" = 2 ] || { echo "FAIL: group_member 0"; failed=1; }
+[ "$(wc -l < "$work/member1")" = 1 ] || { echo "FAIL: group_member 1"; failed=1; }
+
+echo "checking: snapshots"
+configure "snapshot_maxage 600" "snapshot_dir $work/snap"
+"$top_builddir/src/nss_external_snapshot" passwd group \
+  || { echo "FAIL: nss_external_snapshot"; failed=1; }
+NSS_EXTERNAL_STATS=$work/snapshot
+export NSS_EXTERNAL_STATS
+expect "$user1
+$user2
+NOTFOUND
+group19:x:1019:user19,user0" "$MODULE" pwnam=user1 pwuid=1002 pwnam=nobody grgid=1019
+unset NSS_EXTERNAL_STATS
+
+# As with the daemon's segments, only snapshots owned by root, and
+# writable by nobody else, are trusted.
+
+if [ "$(id -u)" = 0 ]
+then
+  stats "$work/snapshot" "snapshot_answers 4" "spawns 0"
+
+  chmod g+w "$work/snap/passwd"
+  NSS_EXTERNAL_STATS=$work/writable
+  export NSS_EXTERNAL_STATS
+  expect "$user1" "$MODULE" pwnam=user1
+  unset NSS_EXTERNAL_STATS
+  stats "$work/writable" "snapshot_answers 0" "spawns 1"
+
+  chmod g-w "$work/snap/passwd"
+  chown 1 "$work/snap/passwd"
+  NSS_EXTERNAL_STATS=$work/notroot
+  export NSS_EXTERNAL_STATS
+  expect "$user1" "$MODULE" pwnam=user1
+  unset NSS_EXTERNAL_STATS
+  stats "$work/notroot" "snapshot_answers 0" "spawns 1"
+else
+  stats "$work/snapshot" "snapshot_answers 0"
+fi
+
+echo "checking: statistics"
+configure
+NSS_EXTERNAL_STATS=$work/stats "$DRIVER" "$MODULE" pwnam=user1 pwnam=user1 >/dev/null
+stats "$work/stats" "getpwnam 2" "spawns 1" "cache_hits 1" "cache_misses 1"
+
+echo "checking: negative cache"
+configure
+NSS_EXTERNAL_STATS=$work/negative "$DRIVER" "$MODULE" pwnam=nobody \
+  pwnam=nobody pwuid=1500 pwuid=1500 >/dev/null
+stats "$work/negative" "spawns 2" "negative_hits 2" "cache_hits 0"
+configure "passwd_negttl 0"
+NSS_EXTERNAL_STATS=$work/nonegative "$DRIVER" "$MODULE" pwnam=nobody \
+  pwnam=nobody >/dev/null
+stats "$work/nonegative" "spawns 2" "negative_hits 0"
+
+echo "checking: eviction"
+configure "passwd_cachesize 4"
+NSS_EXTERNAL_STATS=$work/evict "$DRIVER" "$MODULE" pwnam=user1 pwnam=user2 \
+  pwnam=user1 pwnam=user3 pwnam=user1 pwnam=user2 >/dev/null
+stats "$work/evict" "spawns 4" "cache_hits 2"
+
+echo "checking: names below the minimum id"
+configure "minuid 1005"
+NSS_EXTERNAL_STATS=$work/below
+export NSS_EXTERNAL_STATS
+expect "NOTFOUND
+NOTFOUND" "$MODULE" pwnam=user1 pwnam=user1
+unset NSS_EXTERNAL_STATS
+stats "$work/below" "spawns 1" "cache_hits 1" "parse_failures 0"
+
+echo "checking: buffer retries"
+configure "group_cachesize 0"
+NSS_EXTERNAL_STATS=$work/retries
+export NSS_EXTERNAL_STATS
+expect "group1:x:1001:user1,user2" -g -s 16 "$MODULE" grgid=1001
+unset NSS_EXTERNAL_STATS
+stats "$work/retries" "getgrgid 3" "erange 2" "spawns 1"
+NSS_EXTERNAL_STATS=$work/noretry
+export NSS_EXTERNAL_STATS
+expect "ERANGE
+ERANGE" -s 16 "$MODULE" grgid=1001 sleep=300 grgid=1001
+unset NSS_EXTERNAL_STATS
+stats "$work/noretry" "spawns 2"
+
+echo "checking: background refresh"
+configure "passwd_ttl 1"
+MOCK_LOG=$work/refresh
+export MOCK_LOG
+expect "$user1
+$user1" "$MODULE" pwnam=user1 sleep=1500 pwnam=user1 sleep=500
+unset MOCK_LOG
+expect "$user1
+$user1
+$user1" "$MODULE" pwnam=user1 sleep=1500 pwnam=user1 fork=user1
+got=$(cat "$work/refresh")
+want="passwd user1 0000000000000000
+passwd user1 0000000000000000"
+[ "$got" = "$want" ] || { echo "FAIL: refresh"; echo "  got: $got"; failed=1; }
+
+echo "checking: daemon"
+configure "mode daemon" "socket_path $work/sock" "shm_path $work/shm"
+MOCK_LOG=$work/daemon
+export MOCK_LOG
+"$top_builddir/src/nss_externald" -f &
+daemon=$!
+unset MOCK_LOG
+tries=0
+while [ ! -S "$work/sock" ] && [ $tries -lt 50 ]
+do
+  sleep 0.1
+  tries=$((tries + 1))
+done
+
+NSS_EXTERNAL_STATS=$work/roundtrip
+export NSS_EXTERNAL_STATS
+expect "$user1" "$MODULE" pwnam=user1
+unset NSS_EXTERNAL_STATS
+stats "$work/roundtrip" "daemon_answers 1" "spawns 0"
+
+# The library only trusts segments owned by root, as the daemon's are
+# when it runs as root.
+
+if [ "$(id -u)" = 0 ]
+then
+  sleep 1.5
+  NSS_EXTERNAL_STATS=$work/segment
+  export NSS_EXTERNAL_STATS
+  expect "$user1" "$MODULE" pwnam=user1
+  unset NSS_EXTERNAL_STATS
+  stats "$work/segment" "segment_answers 1" "daemon_answers 0"
+
+  # An odd sequence count means the daemon is part way through
+  # rewriting the table, so the reader must go to the daemon.
+
+  dd if="$work/shm.passwd" of="$work/seq" bs=1 skip=8 count=1 2>/dev/null
+  printf '\001' | dd of="$work/shm.passwd" bs=1 seek=8 conv=notrunc 2>/dev/null
+  NSS_EXTERNAL_STATS=$work/seqlock
+  export NSS_EXTERNAL_STATS
+  expect "$user1" "$MODULE" pwnam=user1
+  unset NSS_EXTERNAL_STATS
+  stats "$work/seqlock" "segment_answers 0" "daemon_answers 1"
+  dd if="$work/seq" of="$work/shm.passwd" bs=1 seek=8 conv=notrunc 2>/dev/null
+
+  chown 1 "$work/shm.passwd"
+  NSS_EXTERNAL_STATS=$work/owner
+  export NSS_EXTERNAL_STATS
+  expect "$user1" "$MODULE" pwnam=user1
+  unset NSS_EXTERNAL_STATS
+  stats "$work/owner" "segment_answers 0" "daemon_answers 1"
+fi
+
+kill $daemon
+wait $daemon 2>/dev/null
+[ "$(wc -l < "$work/daemon")" -eq 1 ] || { echo "FAIL: daemon spawns"; failed=1; }
+
+exit $failed
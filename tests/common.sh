@@ -0,0 +1,38 @@
+# Sourced by check.sh and bench.sh: make a scratch directory holding the
+# mock commands, and a configuration file pointing the module at them.
+
+MODULE=${MODULE:-$top_builddir/src/.libs/libnss_external.so}
+DRIVER=${DRIVER:-./nss_driver}
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/nss-external.XXXXXX") || exit 99
+trap 'rm -rf "$work"' EXIT
+
+mockdb=$(cd "$srcdir" && pwd)/mockdb
+for db in passwd group shadow
+do
+  ln -s "$mockdb" "$work/$db"
+done
+
+NSS_EXTERNAL_CONF=$work/nss-external.conf
+export NSS_EXTERNAL_CONF
+
+# configure [setting...]: write a configuration using the mock commands,
+# run directly, plus the settings given, one per argument.
+
+configure ()
+{
+  {
+    echo "mode spawn"
+    echo "snapshot_maxage 0"
+    for db in passwd group shadow
+    do
+      echo "${db}_command $work/$db"
+    done
+    for setting in "$@"
+    do
+      echo "$setting"
+    done
+  } > "$NSS_EXTERNAL_CONF"
+}
+
+configure
@@ -0,0 +1,593 @@
+/*
+ * nss_external: NSS module for providing NSS services from an external
+ * command.
+ *
+ * Copyright (C) 2016 Scott Balneaves <sbalneav@ltsp.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * nss_driver: load the module with dlopen(), and call its entry points
+ * directly, as glibc would.
+ *
+ *   nss_driver [-g] [-s bufsize] module query...
+ *
+ * prints the result of each query: pwnam=NAME, pwuid=UID, grnam=NAME,
+ * grgid=GID, spnam=NAME, initgroups=USER:GID, pwent or grent; sleep=MS
+ * pauses between queries.  pwent=NAME also looks NAME up after each
+ * entry, and once more at the end before endpwent, printing the first
+ * of those lookups to fail, or else the last.  fork=NAME looks NAME up
+ * in a child process.  Entries are printed in the form of the files
+ * they come from, anything else as the status name.  With -g, a query
+ * that fails with ERANGE is retried with a buffer twice the size, as
+ * glibc does.
+ *
+ *   nss_driver -a module query...
+ *
+ * starts the keyed queries all at once through the asynchronous lookup
+ * API, and prints each result as it completes.  A sleep waits for those
+ * started before it to complete first.
+ *
+ *   nss_driver -b [-n count] module query...
+ *
+ * benchmarks each query instead, reporting lookups per second, median
+ * and 99th percentile latency, peak RSS and allocations per lookup.
+ * Keyed queries take a range, as in pwuid=0-999, and cycle through the
+ * keys user<n>, group<n> or id 1000+n; pwent and grent time whole
+ * enumerations.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <nss.h>
+#include <pwd.h>
+#include <grp.h>
+#include <shadow.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+typedef enum nss_status (*getpwnam_t) (const char *, struct passwd *,
+				       char *, size_t, int *);
+typedef enum nss_status (*getpwuid_t) (uid_t, struct passwd *, char *,
+				       size_t, int *);
+typedef enum nss_status (*getgrnam_t) (const char *, struct group *,
+				       char *, size_t, int *);
+typedef enum nss_status (*getgrgid_t) (gid_t, struct group *, char *,
+				       size_t, int *);
+typedef enum nss_status (*getspnam_t) (const char *, struct spwd *,
+				       char *, size_t, int *);
+typedef enum nss_status (*setent_t) (void);
+typedef enum nss_status (*getpwent_t) (struct passwd *, char *, size_t,
+				       int *);
+typedef enum nss_status (*getgrent_t) (struct group *, char *, size_t,
+				       int *);
+typedef enum nss_status (*initgroups_t) (const char *, gid_t, long *,
+					 long *, gid_t **, long, int *);
+typedef void (*done_t) (enum nss_status, int, void *, void *);
+typedef void *(*lookup_async_t) (const char *, int, const char *, done_t,
+				 void *);
+typedef int (*async_t) (void *);
+
+static void *module;
+static size_t bufsize = 1024;
+static char *buffer;
+static int grow;
+
+/*
+ * Count allocations, by standing in for malloc() and friends in front
+ * of the C library's own.
+ */
+
+extern void *__libc_malloc (size_t);
+extern void *__libc_calloc (size_t, size_t);
+extern void *__libc_realloc (void *, size_t);
+
+static unsigned long allocations;
+
+void *
+malloc (size_t size)
+{
+  __atomic_add_fetch (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n, size_t size)
+{
+  __atomic_add_fetch (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc (n, size);
+}
+
+void *
+realloc (void *p, size_t size)
+{
+  __atomic_add_fetch (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc (p, size);
+}
+
+static void *
+symbol (const char *sym)
+{
+  void *fn;
+
+  if ((fn = dlsym (module, sym)) == NULL)
+    {
+      fprintf (stderr, "%s: %s\n", sym, dlerror ());
+      exit (2);
+    }
+
+  return fn;
+}
+
+static void *
+entry (const char *name)
+{
+  char sym[64];
+
+  snprintf (sym, sizeof sym, "_nss_external_%s", name);
+  return symbol (sym);
+}
+
+static const char *
+statusname (enum nss_status status, int err)
+{
+  switch (status)
+    {
+    case NSS_STATUS_SUCCESS:
+      return "SUCCESS";
+    case NSS_STATUS_NOTFOUND:
+      return "NOTFOUND";
+    case NSS_STATUS_UNAVAIL:
+      return "UNAVAIL";
+    case NSS_STATUS_TRYAGAIN:
+      return (err == ERANGE) ? "ERANGE" : "TRYAGAIN";
+    default:
+      return "RETURN";
+    }
+}
+
+static void
+printpw (struct passwd *pw)
+{
+  printf ("%s:%s:%u:%u:%s:%s:%s\n", pw->pw_name, pw->pw_passwd,
+	  (unsigned) pw->pw_uid, (unsigned) pw->pw_gid, pw->pw_gecos,
+	  pw->pw_dir, pw->pw_shell);
+}
+
+static void
+printgr (struct group *gr)
+{
+  char **m;
+
+  printf ("%s:%s:%u:", gr->gr_name, gr->gr_passwd, (unsigned) gr->gr_gid);
+  for (m = gr->gr_mem; *m != NULL; m++)
+      printf ("%s%s", (m == gr->gr_mem) ? "" : ",", *m);
+  printf ("\n");
+}
+
+/*
+ * query:
+ *
+ * Run a single query.  Returns the number of entries it produced, and
+ * prints them if verbose is set.
+ */
+
+static int
+query (const char *op, const char *arg, int verbose)
+{
+  enum nss_status status = NSS_STATUS_SUCCESS;
+  struct passwd pw;
+  struct group gr;
+  struct spwd sp;
+  int err = 0, n = 0;
+
+  if (strcmp (op, "pwnam") == 0)
+    {
+      status = ((getpwnam_t) entry ("getpwnam_r")) (arg, &pw, buffer,
+						     bufsize, &err);
+      if ((status == NSS_STATUS_SUCCESS) && verbose)
+	  printpw (&pw);
+    }
+  else if (strcmp (op, "pwuid") == 0)
+    {
+      status = ((getpwuid_t) entry ("getpwuid_r"))
+	((uid_t) strtoul (arg, NULL, 10), &pw, buffer, bufsize, &err);
+      if ((status == NSS_STATUS_SUCCESS) && verbose)
+	  printpw (&pw);
+    }
+  else if (strcmp (op, "grnam") == 0)
+    {
+      status = ((getgrnam_t) entry ("getgrnam_r")) (arg, &gr, buffer,
+						     bufsize, &err);
+      if ((status == NSS_STATUS_SUCCESS) && verbose)
+	  printgr (&gr);
+    }
+  else if (strcmp (op, "grgid") == 0)
+    {
+      status = ((getgrgid_t) entry ("getgrgid_r"))
+	((gid_t) strtoul (arg, NULL, 10), &gr, buffer, bufsize, &err);
+      if ((status == NSS_STATUS_SUCCESS) && verbose)
+	  printgr (&gr);
+    }
+  else if (strcmp (op, "spnam") == 0)
+    {
+      status = ((getspnam_t) entry ("getspnam_r")) (arg, &sp, buffer,
+						     bufsize, &err);
+      if ((status == NSS_STATUS_SUCCESS) && verbose)
+	  printf ("%s:%s:%ld\n", sp.sp_namp, sp.sp_pwdp, sp.sp_lstchg);
+    }
+  else if (strcmp (op, "initgroups") == 0)
+    {
+      long start = 0, size = 4, i;
+      gid_t *groups = malloc (size * sizeof (gid_t));
+      char user[256], *gid;
+
+      snprintf (user, sizeof user, "%s", arg);
+      if ((gid = strchr (user, ':')) != NULL)
+	  *gid++ = '\0';
+
+      status = ((initgroups_t) entry ("initgroups_dyn"))
+	(user, gid ? atoi (gid) : 0, &start, &size, &groups, 0, &err);
+
+      if ((status == NSS_STATUS_SUCCESS) && verbose)
+	{
+	  for (i = 0; i < start; i++)
+	      printf ("%s%u", i ? " " : "", (unsigned) groups[i]);
+	  printf ("\n");
+	}
+      free (groups);
+    }
+  else if (strcmp (op, "sleep") == 0)
+    {
+      usleep (atol (arg) * 1000);
+      return 0;
+    }
+  else if (strcmp (op, "fork") == 0)
+    {
+      pid_t pid;
+
+      fflush (stdout);
+      if ((pid = fork ()) == 0)
+	  exit (query ("pwnam", arg, verbose) ? 0 : 1);
+      if ((pid < 0) || (waitpid (pid, NULL, 0) < 0))
+	{
+	  perror ("fork");
+	  exit (2);
+	}
+      return 0;
+    }
+  else if (strcmp (op, "pwent") == 0)
+    {
+      struct passwd found;
+      char other[1024];
+
+      ((setent_t) entry ("setpwent")) ();
+      while ((status = ((getpwent_t) entry ("getpwent_r"))
+	      (&pw, buffer, bufsize, &err)) == NSS_STATUS_SUCCESS)
+	{
+	  if (verbose)
+	      printpw (&pw);
+	  n++;
+
+	  if ((*arg != '\0')
+	      && ((status = ((getpwnam_t) entry ("getpwnam_r"))
+		   (arg, &found, other, sizeof other, &err))
+		  != NSS_STATUS_SUCCESS))
+	      break;
+	}
+
+      if ((*arg != '\0') && (status == NSS_STATUS_NOTFOUND)
+	  && ((status = ((getpwnam_t) entry ("getpwnam_r"))
+	       (arg, &found, other, sizeof other, &err))
+	      == NSS_STATUS_SUCCESS) && verbose)
+	  printpw (&found);
+      ((setent_t) entry ("endpwent")) ();
+    }
+  else if (strcmp (op, "grent") == 0)
+    {
+      ((setent_t) entry ("setgrent")) ();
+      while ((status = ((getgrent_t) entry ("getgrent_r"))
+	      (&gr, buffer, bufsize, &err)) == NSS_STATUS_SUCCESS)
+	{
+	  if (verbose)
+	      printgr (&gr);
+	  n++;
+	}
+      ((setent_t) entry ("endgrent")) ();
+    }
+  else
+    {
+      fprintf (stderr, "unknown query %s\n", op);
+      exit (2);
+    }
+
+  if (status == NSS_STATUS_SUCCESS)
+      return 1;
+
+  if (grow && (n == 0) && (status == NSS_STATUS_TRYAGAIN) && (err == ERANGE))
+    {
+      bufsize *= 2;
+      if ((buffer = realloc (buffer, bufsize)) == NULL)
+	{
+	  perror ("realloc");
+	  exit (2);
+	}
+      return query (op, arg, verbose);
+    }
+
+  if (verbose && ((n == 0) || (status != NSS_STATUS_NOTFOUND)))
+      printf ("%s\n", statusname (status, err));
+
+  return n;
+}
+
+/*
+ * done:
+ *
+ * Print the result of an asynchronous lookup, whose query is arg.
+ */
+
+static void
+done (enum nss_status status, int err, void *result, void *arg)
+{
+  const char *op = arg;
+  struct spwd *sp = result;
+
+  if (status != NSS_STATUS_SUCCESS)
+      printf ("%s\n", statusname (status, err));
+  else if (op[0] == 'p')
+      printpw (result);
+  else if (op[0] == 'g')
+      printgr (result);
+  else
+      printf ("%s:%s:%ld\n", sp->sp_namp, sp->sp_pwdp, sp->sp_lstchg);
+}
+
+/*
+ * async:
+ *
+ * Start every query given, and wait for them all.
+ */
+
+static void
+async (char **queries, int n)
+{
+  lookup_async_t start = (lookup_async_t) symbol ("nss_external_lookup_async");
+  async_t fd = (async_t) symbol ("nss_external_async_fd");
+  async_t timeout = (async_t) symbol ("nss_external_async_timeout");
+  async_t process = (async_t) symbol ("nss_external_async_process");
+  struct pollfd pfds[n];
+  void *lookups[n];
+  int i, t, wait, left = n;
+  char *arg;
+
+  for (i = 0; i < n; i++)
+    {
+      const char *db;
+      int by;
+
+      if ((arg = strchr (queries[i], '=')) == NULL)
+	{
+	  fprintf (stderr, "query %s needs a key\n", queries[i]);
+	  exit (2);
+	}
+      *arg++ = '\0';
+
+      db = (queries[i][0] == 'p') ? "passwd"
+	   : (queries[i][0] == 'g') ? "group" : "shadow";
+      by = ((strcmp (queries[i], "pwuid") == 0)
+	    || (strcmp (queries[i], "grgid") == 0)) ? 1 : 0;
+
+      if ((lookups[i] = start (db, by, arg, done, queries[i])) == NULL)
+	{
+	  perror (queries[i]);
+	  exit (2);
+	}
+
+      pfds[i].fd = fd (lookups[i]);
+      pfds[i].events = POLLIN;
+    }
+
+  while (left > 0)
+    {
+      for (i = 0, wait = -1; i < n; i++)
+	  if ((pfds[i].fd >= 0) && (((t = timeout (lookups[i])) < wait)
+				    || (wait < 0)))
+	      wait = t;
+
+      poll (pfds, n, wait);
+
+      for (i = 0; i < n; i++)
+	  if ((pfds[i].fd >= 0) && process (lookups[i]))
+	    {
+	      pfds[i].fd = -1;
+	      left--;
+	    }
+    }
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * bench:
+ *
+ * Time count runs of a query, cycling through a range of keys.
+ */
+
+static void
+bench (const char *op, const char *range, long count)
+{
+  double *times, start, t;
+  unsigned long allocs;
+  struct rusage ru;
+  long lo = 0, hi = 0, i, entries = 0;
+  char key[64];
+
+  if (range != NULL)
+      if (sscanf (range, "%ld-%ld", &lo, &hi) < 1)
+	{
+	  fprintf (stderr, "bad range %s\n", range);
+	  exit (2);
+	}
+  if (hi < lo)
+      hi = lo;
+
+  if ((times = malloc (count * sizeof (double))) == NULL)
+    {
+      perror ("malloc");
+      exit (2);
+    }
+
+  allocs = __atomic_load_n (&allocations, __ATOMIC_RELAXED);
+  start = now ();
+
+  for (i = 0; i < count; i++)
+    {
+      long k = lo + i % (hi - lo + 1);
+
+      if ((strcmp (op, "pwuid") == 0) || (strcmp (op, "grgid") == 0))
+	  snprintf (key, sizeof key, "%ld", 1000 + k);
+      else if (strcmp (op, "grnam") == 0)
+	  snprintf (key, sizeof key, "group%ld", k);
+      else
+	  snprintf (key, sizeof key, "user%ld", k);
+
+      t = now ();
+      entries += query (op, key, 0);
+      times[i] = now () - t;
+    }
+
+  t = now () - start;
+  allocs = __atomic_load_n (&allocations, __ATOMIC_RELAXED) - allocs;
+
+  qsort (times, count, sizeof (double), compare);
+  getrusage (RUSAGE_SELF, &ru);
+
+  printf ("%-6s %8ld calls %9ld entries %10.0f calls/s  p50 %9.1fus  "
+	  "p99 %9.1fus  rss %7ld kB  %6.1f allocs/call\n",
+	  op, count, entries, count / t, times[count / 2] * 1e6,
+	  times[count * 99 / 100] * 1e6, ru.ru_maxrss,
+	  (double) allocs / count);
+
+  free (times);
+}
+
+static void
+usage (const char *progname)
+{
+  fprintf (stderr,
+	   "Usage: %s [-a] [-b] [-g] [-n count] [-s bufsize] module query...\n",
+	   progname);
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  long count = 1000;
+  int opt, benchmark = 0, asynchronous = 0, i, j;
+  char *op, *arg;
+
+  while ((opt = getopt (argc, argv, "abgn:s:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'a':
+	  asynchronous = 1;
+	  break;
+	case 'b':
+	  benchmark = 1;
+	  break;
+	case 'g':
+	  grow = 1;
+	  break;
+	case 'n':
+	  count = atol (optarg);
+	  break;
+	case 's':
+	  bufsize = atol (optarg);
+	  break;
+	default:
+	  usage (argv[0]);
+	}
+    }
+
+  if ((optind >= argc) || (count <= 0))
+      usage (argv[0]);
+
+  if ((module = dlopen (argv[optind], RTLD_NOW)) == NULL)
+    {
+      fprintf (stderr, "%s\n", dlerror ());
+      return 2;
+    }
+
+  if ((buffer = malloc (bufsize)) == NULL)
+    {
+      perror ("malloc");
+      return 2;
+    }
+
+  /*
+   * Asynchronous queries are started together, up to each sleep.
+   */
+
+  for (i = optind + 1; asynchronous && (i < argc); i = j + 1)
+    {
+      for (j = i; (j < argc) && (strncmp (argv[j], "sleep=", 6) != 0); j++);
+
+      if (j > i)
+	  async (argv + i, j - i);
+      if (j < argc)
+	  usleep (atol (argv[j] + 6) * 1000);
+    }
+
+  for (i = optind + 1; !asynchronous && (i < argc); i++)
+    {
+      op = argv[i];
+      if ((arg = strchr (op, '=')) != NULL)
+	  *arg++ = '\0';
+
+      if (benchmark)
+	  bench (op, arg, count);
+      else
+	  query (op, arg ? arg : "", 1);
+    }
+
+  free (buffer);
+
+  return 0;
+}